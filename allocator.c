@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "allocator.h"
+
+#define ALIGNMENT 16 // of every block handed out, enough for any scalar type
+#define DEFAULT_ARENA_BLOCK (64*1024)
+#define DEFAULT_SLAB_OBJECTS 256
+
+#define ALIGN_UP(n) (((n)+ALIGNMENT-1) & ~(size_t)(ALIGNMENT-1))
+
+static void *heap_alloc(void *ctx, size_t size){
+  return malloc(size) ;
+}
+
+static void *heap_realloc(void *ctx, void *ptr, size_t oldsize, size_t newsize){
+  return realloc(ptr , newsize) ;
+}
+
+static void heap_free(void *ctx, void *ptr, size_t size){
+  free(ptr) ;
+}
+
+const CAllocator callocator_heap = { heap_alloc , heap_realloc , heap_free , NULL } ;
+
+/*
+  A block of an arena. Blocks are chained from the newest one, the data follows the header.
+ */
+struct block {
+  struct block *prev ;
+  size_t size ;
+};
+
+/*
+  A bump arena: memory is handed out by moving top forward through the current block, and a new block is chained on
+  when it does not fit. Freeing a single allocation only gives its memory back if it was the last one,
+  everything is released at once by carena_reset or carena_dispose.
+ */
+struct arena {
+  struct block *current ;
+  char *top , *end ;
+  char *last ; // the most recent allocation, which can still be grown or freed in place
+  size_t block_size ;
+};
+
+/*
+  Takes as input the size of the blocks the arena gets from malloc (block_size, 0 for 64 KiB) and returns an empty arena.
+  Allocations larger than a block get a block of their own.
+ */
+CArena *carena_create(size_t block_size){
+  CArena *arena = calloc(sizeof(CArena) , 1) ;
+  if(arena == NULL) assert("Allocation failure") ;
+  arena->block_size = (block_size == 0) ? DEFAULT_ARENA_BLOCK : block_size ;
+  return arena ;
+}
+
+static void *arena_alloc(void *ctx, size_t size){
+  CArena *arena = ctx ;
+  size = ALIGN_UP(size) ;
+  if(arena->current == NULL || (size_t)(arena->end-arena->top) < size){
+    size_t data = (size > arena->block_size) ? size : arena->block_size ;
+    struct block *b = malloc(ALIGN_UP(sizeof(struct block))+data) ;
+    if(b == NULL) return NULL ;
+    b->prev = arena->current ;
+    b->size = data ;
+    arena->current = b ;
+    arena->top = (char*)b+ALIGN_UP(sizeof(struct block)) ;
+    arena->end = arena->top+data ;
+  }
+  arena->last = arena->top ;
+  arena->top += size ;
+  return arena->last ;
+}
+
+static void *arena_realloc(void *ctx, void *ptr, size_t oldsize, size_t newsize){
+  CArena *arena = ctx ;
+  if(ptr != NULL && ptr == arena->last && (size_t)(arena->end-arena->last) >= ALIGN_UP(newsize)){ // grow or shrink in place
+    arena->top = arena->last+ALIGN_UP(newsize) ;
+    return ptr ;
+  }
+  void *moved = arena_alloc(ctx , newsize) ;
+  if(moved != NULL && ptr != NULL) memcpy(moved , ptr , (oldsize < newsize) ? oldsize : newsize) ;
+  return moved ;
+}
+
+static void arena_free(void *ctx, void *ptr, size_t size){
+  CArena *arena = ctx ;
+  if(ptr != NULL && ptr == arena->last){
+    arena->top = arena->last ;
+    arena->last = NULL ;
+  }
+}
+
+/*
+  Takes as input a CArena (arena) and frees everything allocated from it, keeping its newest block for reuse.
+  Structures that used the arena must not be used or disposed afterwards, and their cleanup functions are not called.
+ */
+void carena_reset(CArena *arena){
+  if(arena->current == NULL) return ;
+  for(struct block *b = arena->current->prev , *prev ; b != NULL ; b = prev){
+    prev = b->prev ;
+    free(b) ;
+  }
+  arena->current->prev = NULL ;
+  arena->top = (char*)arena->current+ALIGN_UP(sizeof(struct block)) ;
+  arena->end = arena->top+arena->current->size ;
+  arena->last = NULL ;
+}
+
+/*
+  Takes as input a CArena (arena) and frees it along with everything allocated from it.
+ */
+void carena_dispose(CArena *arena){
+  for(struct block *b = arena->current , *prev ; b != NULL ; b = prev){
+    prev = b->prev ;
+    free(b) ;
+  }
+  free(arena) ;
+}
+
+/*
+  Takes as input a CArena (arena) and returns an allocator that allocates from it.
+ */
+CAllocator carena_allocator(CArena *arena){
+  return (CAllocator){ arena_alloc , arena_realloc , arena_free , arena } ;
+}
+
+/*
+  A pool of objects of one size carved out of slabs, with a free list threaded through the freed objects.
+  Requests larger than the object size, like the bucket array of a map, are passed on to malloc.
+ */
+struct pool {
+  size_t objsz , per_slab ;
+  void *free_list ;
+  void *slabs ; // each slab starts with a pointer to the previous one
+  char *next , *end ; // the part of the newest slab not handed out yet
+};
+
+/*
+  Takes as input the size of the objects (objsz) and the number of them per slab (per_slab, 0 for 256) and returns an empty pool.
+ */
+CPool *cpool_create(size_t objsz, size_t per_slab){
+  CPool *pool = calloc(sizeof(CPool) , 1) ;
+  if(pool == NULL) assert("Allocation failure") ;
+  pool->objsz = ALIGN_UP(objsz < sizeof(void*) ? sizeof(void*) : objsz) ;
+  pool->per_slab = (per_slab == 0) ? DEFAULT_SLAB_OBJECTS : per_slab ;
+  return pool ;
+}
+
+static void *pool_alloc(void *ctx, size_t size){
+  CPool *pool = ctx ;
+  if(size > pool->objsz) return malloc(size) ;
+  if(pool->free_list != NULL){
+    void *obj = pool->free_list ;
+    pool->free_list = *(void**)obj ;
+    return obj ;
+  }
+  if(pool->next == pool->end){
+    char *slab = malloc(ALIGNMENT+pool->objsz*pool->per_slab) ;
+    if(slab == NULL) return NULL ;
+    *(void**)slab = pool->slabs ;
+    pool->slabs = slab ;
+    pool->next = slab+ALIGNMENT ;
+    pool->end = pool->next+pool->objsz*pool->per_slab ;
+  }
+  void *obj = pool->next ;
+  pool->next += pool->objsz ;
+  return obj ;
+}
+
+static void pool_free(void *ctx, void *ptr, size_t size){
+  CPool *pool = ctx ;
+  if(ptr == NULL) return ;
+  if(size > pool->objsz){
+    free(ptr) ;
+    return ;
+  }
+  *(void**)ptr = pool->free_list ;
+  pool->free_list = ptr ;
+}
+
+static void *pool_realloc(void *ctx, void *ptr, size_t oldsize, size_t newsize){
+  CPool *pool = ctx ;
+  if(ptr == NULL) return pool_alloc(ctx , newsize) ;
+  if(oldsize > pool->objsz && newsize > pool->objsz) return realloc(ptr , newsize) ;
+  if(oldsize <= pool->objsz && newsize <= pool->objsz) return ptr ; // the object already has room
+  void *moved = pool_alloc(ctx , newsize) ;
+  if(moved == NULL) return NULL ;
+  memcpy(moved , ptr , (oldsize < newsize) ? oldsize : newsize) ;
+  pool_free(ctx , ptr , oldsize) ;
+  return moved ;
+}
+
+/*
+  Takes as input a CPool (pool) and frees its slabs. Blocks too large for the pool were given to malloc
+  and are freed by the structures that own them.
+ */
+void cpool_dispose(CPool *pool){
+  for(void *slab = pool->slabs , *prev ; slab != NULL ; slab = prev){
+    prev = *(void**)slab ;
+    free(slab) ;
+  }
+  free(pool) ;
+}
+
+/*
+  Takes as input a CPool (pool) and returns an allocator that allocates from it.
+ */
+CAllocator cpool_allocator(CPool *pool){
+  return (CAllocator){ pool_alloc , pool_realloc , pool_free , pool } ;
+}
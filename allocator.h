@@ -0,0 +1,33 @@
+#ifndef _allocator_h
+#define _allocator_h
+
+#include <stddef.h>
+
+/*
+  CAllocator is where a CVector or CMap created with cvec_create_with or cmap_create_with gets its memory.
+  The sizes of the block being resized or freed are passed back, so an allocator does not have to record them.
+  See allocator.c for the description of each function.
+ */
+typedef struct {
+  void *(*alloc)(void *ctx, size_t size);
+  void *(*realloc)(void *ctx, void *ptr, size_t oldsize, size_t newsize);
+  void (*free)(void *ctx, void *ptr, size_t size);
+  void *ctx;
+} CAllocator;
+
+extern const CAllocator callocator_heap; // malloc, realloc and free, what cvec_create and cmap_create use
+
+typedef struct arena CArena;
+
+CArena *carena_create(size_t block_size);
+void carena_reset(CArena *arena);
+void carena_dispose(CArena *arena);
+CAllocator carena_allocator(CArena *arena);
+
+typedef struct pool CPool;
+
+CPool *cpool_create(size_t objsz, size_t per_slab);
+void cpool_dispose(CPool *pool);
+CAllocator cpool_allocator(CPool *pool);
+
+#endif
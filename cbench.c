@@ -0,0 +1,799 @@
+/*
+  Benchmark for the CVector and CMap data structures.
+
+  Each row times one operation done two ways on the same elements, the old way and the faster one, and prints the
+  time per element for both. The results are compared so a row only counts if both ways computed the same thing.
+  The vector rows compare the generic CVector (runtime elemsz, memcpy) with the CVEC_DEFINE typed vector,
+  the bulk rows compare element at a time calls with the range APIs, the sort rows compare qsort
+  (cvec_sort) with the cvec_sort_* paths, and the search rows compare bsearch and lfind with the search index and the
+  SIMD scan. The traversal rows compare a cvec_first/cvec_next loop with cvec_for_each and cvec_reduce. The allocator rows compare building and tearing down many small maps and vectors on the heap with a slab pool
+  and a bump arena. The hash rows compare the byte at a time hash CMap used to have, and its % bucket index, with cmap_hash and
+  a power of two mask, on short numbered keys, file names and long paths; they check that the new hash fills the buckets as
+  evenly as a random function would. The slice row compares copying lines of a buffer out to look them up with cmap_get_n.
+  The dump row compares reading every pair of a sparse map through cmap_first/cmap_next and cmap_get with cmap_for_each.
+  The mapped rows compare building a map with cmap_put at startup with mapping a saved image, and lookups in both.
+  The freeze row compares building a map of N numbered keys with cmap_put with building its image with cmap_freeze,
+  which must succeed and find every key however large N is.
+  The concurrent rows run 1 to 64 threads doing 90% lookups, 5% puts and 5% removes on one map, a CMap behind a mutex
+  against a CCMap. They double as a stress test: every value holds its number twice and a reader that sees two different
+  numbers saw a torn value, and since each thread only writes its own keys both maps must end up the same. The CCMap
+  counts the calls of its cleanup function, which must come once for every value put, after it is replaced or removed
+  and no reader can see it any more, or at dispose, and never for a value a resize copied to a bigger table.
+
+  Build: gcc -O2 -pthread -o cbench cbench.c vector.c map.c ccmap.c allocator.c -lm
+  Usage: cbench [N]     (number of elements, 10000000 by default)
+  Exits with status 1 if the two ways of any row disagree.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <search.h>
+#include <error.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include "cvector.h"
+#include "cmap.h"
+#include "ccmap.h"
+
+#define DEFAULT_N 10000000
+#define INSERT_N 20000 // inserts at the front are quadratic, only this many are timed
+#define SEARCH_N 1000000 // lookups timed on the sorted vector
+#define SCAN_N 4096 // vector size and number of lookups for the unsorted scans
+#define SMALL_MAP 64 // entries in each of the short-lived maps
+#define HASH_KEYS 65536 // distinct keys of each kind hashed by the hash rows
+#define SHARED_KEYS 65536 // keys of the map shared by the threads of the concurrent rows
+#define MAX_THREADS 64
+
+#define INT_LESS(a, b) ((a) < (b))
+
+CVEC_DEFINE(int)
+CVEC_DEFINE_SORT(int, int, INT_LESS)
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+/*
+  xorshift64*, seeded with a constant so every run uses the same data.
+ */
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_int(const int *a, const int *b)
+{
+    return (*a > *b) - (*a < *b);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void add_int(void *sum, const void *elem, void *aux)
+{
+    *(long *)sum += *(const int *)elem;
+}
+
+static void add_long(void *sum, const void *partial, void *aux)
+{
+    *(long *)sum += *(const long *)partial;
+}
+
+static void visit_add(void *elem, void *sum)
+{
+    *(long *)sum += *(int *)elem;
+}
+
+static size_t nbad;
+
+/*
+  Prints one row: the time per element of the old and the new way and whether they agree.
+ */
+static void report(const char *what, size_t n, double old, double new, bool same)
+{
+    printf("%-28s %12.2f %12.2f %8.1fx  %s\n", what, old / n * 1e9, new / n * 1e9, old / new, same ? "ok" : "MISMATCH");
+    nbad += !same;
+}
+
+/*
+  Append, sum through nth, sum through first/next, insertion at the front and qsort, on both vectors.
+ */
+static void bench_vector(size_t n)
+{
+    int *data = malloc(n * sizeof(int));
+    if (data == NULL) error(1, 0, "Allocation failure");
+    for (size_t i = 0; i < n; i++) data[i] = (int)(rng() >> 33);
+
+    double t = now();
+    CVector *cv = cvec_create(sizeof(int), 0, NULL);
+    for (size_t i = 0; i < n; i++) cvec_append(cv, &data[i]);
+    double generic = now() - t;
+    t = now();
+    CVector_int *tv = cvec_int_create(0, NULL);
+    for (size_t i = 0; i < n; i++) cvec_int_append(tv, data[i]);
+    report("append", n, generic, now() - t, cvec_count(cv) == cvec_int_count(tv));
+
+    long gsum = 0, tsum = 0;
+    t = now();
+    for (int i = 0; i < cvec_count(cv); i++) gsum += *(int *)cvec_nth(cv, i);
+    generic = now() - t;
+    t = now();
+    for (int i = 0; i < cvec_int_count(tv); i++) tsum += *cvec_int_nth(tv, i);
+    report("sum by nth", n, generic, now() - t, gsum == tsum);
+
+    gsum = tsum = 0;
+    t = now();
+    for (int *p = cvec_first(cv); p != NULL; p = cvec_next(cv, p)) gsum += *p;
+    generic = now() - t;
+    t = now();
+    for (int *p = cvec_int_first(tv); p != NULL; p = cvec_int_next(tv, p)) tsum += *p;
+    report("sum by first/next", n, generic, now() - t, gsum == tsum);
+
+    CVector *cfront = cvec_create(sizeof(int), 0, NULL);
+    CVector_int *tfront = cvec_int_create(0, NULL);
+    t = now();
+    for (size_t i = 0; i < INSERT_N; i++) cvec_insert(cfront, &data[i], 0);
+    generic = now() - t;
+    t = now();
+    for (size_t i = 0; i < INSERT_N; i++) cvec_int_insert(tfront, data[i], 0);
+    report("insert at front", INSERT_N, generic, now() - t,
+           memcmp(cvec_first(cfront), cvec_int_first(tfront), INSERT_N * sizeof(int)) == 0);
+    cvec_dispose(cfront);
+    cvec_int_dispose(tfront);
+
+    t = now();
+    cvec_sort(cv, (CompareFn)cmp_int);
+    generic = now() - t;
+    t = now();
+    cvec_int_sort(tv, cmp_int);
+    report("sort (qsort)", n, generic, now() - t, memcmp(cvec_first(cv), cvec_int_first(tv), n * sizeof(int)) == 0);
+
+    cvec_dispose(cv);
+    cvec_int_dispose(tv);
+    free(data);
+}
+
+/*
+  Inserting a block in the middle and removing it one element at a time against cvec_insert_range and cvec_remove_range,
+  appending with and without cvec_reserve, and the memory left over after appending n elements
+  with the default growth factor, with 1.5 and after cvec_shrink_to_fit.
+ */
+static void bench_bulk(size_t n)
+{
+    int *data = malloc(n * sizeof(int));
+    if (data == NULL) error(1, 0, "Allocation failure");
+    for (size_t i = 0; i < n; i++) data[i] = (int)i;
+
+    CVector *one = cvec_create(sizeof(int), 0, NULL), *bulk = cvec_create(sizeof(int), 0, NULL);
+    cvec_append_n(one, data, INSERT_N);
+    cvec_append_n(bulk, data, INSERT_N);
+    double t = now();
+    for (size_t i = 0; i < INSERT_N; i++) cvec_insert(one, &data[i], INSERT_N / 2 + i);
+    double old = now() - t;
+    t = now();
+    cvec_insert_range(bulk, data, INSERT_N, INSERT_N / 2);
+    report("insert block in middle", INSERT_N, old, now() - t,
+           memcmp(cvec_first(one), cvec_first(bulk), 2 * INSERT_N * sizeof(int)) == 0);
+
+    t = now();
+    for (size_t i = 0; i < INSERT_N; i++) cvec_remove(one, INSERT_N / 2);
+    old = now() - t;
+    t = now();
+    cvec_remove_range(bulk, INSERT_N / 2, INSERT_N);
+    report("remove block in middle", INSERT_N, old, now() - t,
+           cvec_count(one) == cvec_count(bulk) && memcmp(cvec_first(one), cvec_first(bulk), INSERT_N * sizeof(int)) == 0);
+    cvec_dispose(one);
+    cvec_dispose(bulk);
+
+    one = cvec_create(sizeof(int), 0, NULL);
+    bulk = cvec_create(sizeof(int), 0, NULL);
+    t = now();
+    for (size_t i = 0; i < n; i++) cvec_append(one, &data[i]);
+    old = now() - t;
+    t = now();
+    cvec_reserve(bulk, n);
+    for (size_t i = 0; i < n; i++) cvec_append(bulk, &data[i]);
+    report("append after cvec_reserve", n, old, now() - t, memcmp(cvec_first(one), cvec_first(bulk), n * sizeof(int)) == 0);
+    cvec_dispose(bulk);
+
+    bulk = cvec_create(sizeof(int), 0, NULL);
+    t = now();
+    cvec_append_n(bulk, data, n);
+    report("cvec_append_n", n, old, now() - t, memcmp(cvec_first(one), cvec_first(bulk), n * sizeof(int)) == 0);
+    cvec_dispose(bulk);
+
+    CVector *factor = cvec_create(sizeof(int), 0, NULL);
+    cvec_set_growth(factor, 1.5);
+    for (size_t i = 0; i < n; i++) cvec_append(factor, &data[i]);
+    printf("%-28s %12.2f %12.2f  (elements allocated per element stored, growth 2 / growth 1.5)\n", "overshoot",
+           (double)cvec_capacity(one) / n, (double)cvec_capacity(factor) / n);
+    cvec_shrink_to_fit(one);
+    printf("%-28s %12.2f\n", "after cvec_shrink_to_fit", (double)cvec_capacity(one) / n);
+    cvec_dispose(factor);
+    cvec_dispose(one);
+    free(data);
+}
+
+/*
+  qsort against the radix sort on int and double keys, the typed introsort and the parallel merge sort.
+ */
+static void bench_sort(size_t n)
+{
+    CVector *base = cvec_create(sizeof(int), n, NULL);
+    for (size_t i = 0; i < n; i++) {
+        int v = (int)rng();
+        cvec_append(base, &v);
+    }
+    CVector *sorted = cvec_create(sizeof(int), n, NULL);
+    cvec_append_n(sorted, cvec_first(base), n);
+    double t = now();
+    cvec_sort(sorted, (CompareFn)cmp_int);
+    double old = now() - t;
+
+    CVector *radix = cvec_create(sizeof(int), n, NULL);
+    cvec_append_n(radix, cvec_first(base), n);
+    CVecKey key = { 0, sizeof(int), CVEC_KEY_SIGNED };
+    t = now();
+    cvec_sort_radix(radix, &key);
+    report("cvec_sort_radix int", n, old, now() - t, memcmp(cvec_first(sorted), cvec_first(radix), n * sizeof(int)) == 0);
+    cvec_dispose(radix);
+
+    CVector_int *typed = cvec_int_create(n, NULL);
+    for (int *p = cvec_first(base); p != NULL; p = cvec_next(base, p)) cvec_int_append(typed, *p);
+    t = now();
+    cvec_int_sort_intro(typed);
+    report("cvec_int_sort_intro", n, old, now() - t, memcmp(cvec_first(sorted), cvec_int_first(typed), n * sizeof(int)) == 0);
+    cvec_int_dispose(typed);
+
+    CVector *parallel = cvec_create(sizeof(int), n, NULL);
+    cvec_append_n(parallel, cvec_first(base), n);
+    t = now();
+    cvec_sort_parallel(parallel, (CompareFn)cmp_int, 0);
+    report("cvec_sort_parallel", n, old, now() - t, memcmp(cvec_first(sorted), cvec_first(parallel), n * sizeof(int)) == 0);
+    cvec_dispose(parallel);
+    cvec_dispose(sorted);
+    cvec_dispose(base);
+
+    CVector *dq = cvec_create(sizeof(double), n, NULL), *dr = cvec_create(sizeof(double), n, NULL);
+    for (size_t i = 0; i < n; i++) {
+        double v = ((double)(int64_t)rng()) / 1e6;
+        cvec_append(dq, &v);
+    }
+    cvec_append_n(dr, cvec_first(dq), n);
+    t = now();
+    cvec_sort(dq, cmp_double);
+    old = now() - t;
+    CVecKey dkey = { 0, sizeof(double), CVEC_KEY_FLOAT };
+    t = now();
+    cvec_sort_radix(dr, &dkey);
+    report("cvec_sort_radix double", n, old, now() - t, memcmp(cvec_first(dq), cvec_first(dr), n * sizeof(double)) == 0);
+    cvec_dispose(dq);
+    cvec_dispose(dr);
+}
+
+/*
+  Lookups of random keys in a sorted vector of n ints with bsearch, cvec_index_search and cvec_index_search_n,
+  then linear scans of a small unsorted vector with lfind and with the SIMD scan of cvec_search.
+ */
+static void bench_search(size_t n)
+{
+    CVector *cv = cvec_create(sizeof(int), n, NULL);
+    for (size_t i = 0; i < n; i++) {
+        int v = (int)(rng() >> 34);
+        cvec_append(cv, &v);
+    }
+    cvec_sort(cv, (CompareFn)cmp_int);
+    int *keys = malloc(SEARCH_N * sizeof(int)), *expect = malloc(SEARCH_N * sizeof(int)), *got = malloc(SEARCH_N * sizeof(int));
+    if (keys == NULL || expect == NULL || got == NULL) error(1, 0, "Allocation failure");
+    for (size_t i = 0; i < SEARCH_N; i++) keys[i] = (i % 2) ? *(int *)cvec_nth(cv, rng() % n) : (int)(rng() >> 34);
+
+    long gsum = 0, tsum = 0;
+    double t = now();
+    for (size_t i = 0; i < SEARCH_N; i++) gsum += bsearch(&keys[i], cvec_first(cv), n, sizeof(int), (CompareFn)cmp_int) != NULL;
+    double old = now() - t;
+    for (size_t i = 0; i < SEARCH_N; i++) expect[i] = cvec_search(cv, &keys[i], (CompareFn)cmp_int, 0, true);
+
+    CVecIndex *ix = cvec_index_create(cv, (CompareFn)cmp_int);
+    t = now();
+    for (size_t i = 0; i < SEARCH_N; i++) got[i] = cvec_index_search(ix, &keys[i]);
+    double elapsed = now() - t;
+    for (size_t i = 0; i < SEARCH_N; i++) tsum += got[i] >= 0;
+    report("cvec_index_search", SEARCH_N, old, elapsed, gsum == tsum && memcmp(expect, got, SEARCH_N * sizeof(int)) == 0);
+
+    t = now();
+    cvec_index_search_n(ix, keys, SEARCH_N, got);
+    report("cvec_index_search_n", SEARCH_N, old, now() - t, memcmp(expect, got, SEARCH_N * sizeof(int)) == 0);
+    cvec_index_dispose(ix);
+    cvec_dispose(cv);
+
+    CVector *small = cvec_create(sizeof(int), SCAN_N, NULL);
+    for (int i = 0; i < SCAN_N; i++) cvec_append(small, &i);
+    size_t count = SCAN_N;
+    gsum = tsum = 0;
+    t = now();
+    for (int i = 0; i < SCAN_N; i++) gsum += (int *)lfind(&i, cvec_first(small), &count, sizeof(int), (CompareFn)cmp_int) - (int *)cvec_first(small);
+    old = now() - t;
+    t = now();
+    for (int i = 0; i < SCAN_N; i++) tsum += cvec_search(small, &i, NULL, 0, false);
+    report("unsorted scan (SIMD)", SCAN_N, old, now() - t, gsum == tsum);
+    cvec_dispose(small);
+    free(keys);
+    free(expect);
+    free(got);
+}
+
+/*
+  Sums n ints with a cvec_first/cvec_next loop, cvec_for_each and cvec_reduce on the shared thread pool.
+ */
+static void bench_traverse(size_t n)
+{
+    CVector *cv = cvec_create(sizeof(int), n, NULL);
+    for (size_t i = 0; i < n; i++) {
+        int v = (int)(rng() >> 40);
+        cvec_append(cv, &v);
+    }
+    long expect = 0, sum = 0;
+    double t = now();
+    for (int *p = cvec_first(cv); p != NULL; p = cvec_next(cv, p)) expect += *p;
+    double old = now() - t;
+
+    t = now();
+    cvec_for_each(cv, visit_add, &sum);
+    report("cvec_for_each", n, old, now() - t, sum == expect);
+
+    sum = 0;
+    cvec_reduce(cv, &sum, sizeof(sum), add_int, add_long, NULL); // starts the pool outside of the timing
+    sum = 0;
+    t = now();
+    cvec_reduce(cv, &sum, sizeof(sum), add_int, add_long, NULL);
+    report("cvec_reduce", n, old, now() - t, sum == expect);
+    cvec_dispose(cv);
+}
+
+/*
+  Builds n/SMALL_MAP maps of SMALL_MAP entries and as many vectors, then tears them all down, with the heap,
+  with a pool for the map cells and with an arena that is reset instead of disposing each structure.
+  Returns the time of the build and teardown in *build and *teardown and a checksum of the values read back.
+ */
+static long build_maps(size_t n, const CAllocator *alloc, CArena *arena, double *build, double *teardown)
+{
+    size_t nmaps = n / SMALL_MAP;
+    CMap **maps = malloc(nmaps * sizeof(CMap *));
+    CVector **vecs = malloc(nmaps * sizeof(CVector *));
+    if (maps == NULL || vecs == NULL) error(1, 0, "Allocation failure");
+    char key[16];
+    long sum = 0;
+
+    double t = now();
+    for (size_t m = 0; m < nmaps; m++) {
+        maps[m] = cmap_create_with(sizeof(int), SMALL_MAP, NULL, alloc);
+        vecs[m] = cvec_create_with(sizeof(int), 0, NULL, alloc);
+        for (int i = 0; i < SMALL_MAP; i++) {
+            int v = (int)(m + i);
+            snprintf(key, sizeof(key), "key%06d", i);
+            cmap_put(maps[m], key, &v);
+            cvec_append(vecs[m], &v);
+        }
+    }
+    *build = now() - t;
+    for (size_t m = 0; m < nmaps; m++) sum += *(int *)cmap_get(maps[m], "key000007") + *(int *)cvec_nth(vecs[m], 9);
+
+    t = now();
+    if (arena != NULL) carena_reset(arena);
+    else {
+        for (size_t m = 0; m < nmaps; m++) {
+            cmap_dispose(maps[m]);
+            cvec_dispose(vecs[m]);
+        }
+    }
+    *teardown = now() - t;
+    free(maps);
+    free(vecs);
+    return sum;
+}
+
+static void bench_alloc(size_t n)
+{
+    double heap_build, heap_teardown, build, teardown;
+    long expect = build_maps(n, &callocator_heap, NULL, &heap_build, &heap_teardown);
+
+    CPool *pool = cpool_create(CMAP_CELL_SIZE(sizeof(int), strlen("key000000")), 0);
+    CAllocator pooled = cpool_allocator(pool);
+    long sum = build_maps(n, &pooled, NULL, &build, &teardown);
+    report("map+vector build (pool)", n, heap_build, build, sum == expect);
+    report("map+vector teardown (pool)", n, heap_teardown, teardown, sum == expect);
+    cpool_dispose(pool);
+
+    CArena *arena = carena_create(0);
+    CAllocator bump = carena_allocator(arena);
+    sum = build_maps(n, &bump, arena, &build, &teardown);
+    report("map+vector build (arena)", n, heap_build, build, sum == expect);
+    report("map+vector teardown (arena)", n, heap_teardown, teardown, sum == expect);
+    carena_dispose(arena);
+}
+
+/*
+ * The hash CMap used before cmap_hash, adapted from Eric Roberts' _The Art and Science of C_
+ */
+static unsigned long roberts_hash(const char *s)
+{
+    const unsigned long MULTIPLIER = 2630849305L;
+    unsigned long hashcode = 0;
+    for (int i = 0; s[i] != '\0'; i++)
+        hashcode = hashcode * MULTIPLIER + s[i];
+    return hashcode;
+}
+
+/*
+  Fills keys with HASH_KEYS distinct keys of one kind: 0 numbered like "key000123", 1 file names of 3 to 14 letters,
+  2 paths of about 50 bytes.
+ */
+static void make_keys(char (*keys)[64], int kind)
+{
+    for (size_t i = 0; i < HASH_KEYS; i++) {
+        if (kind == 0) snprintf(keys[i], 64, "key%06zu", i);
+        else if (kind == 1) {
+            int len = 3 + rng() % 12;
+            for (int c = 0; c < len; c++) keys[i][c] = 'a' + rng() % 26;
+            snprintf(keys[i] + len, 64 - len, "%zu", i); // keeps them distinct
+        }
+        else snprintf(keys[i], 64, "/usr/lib/x86_64-linux-gnu/package-%06zu/lib%04x.so.1", i, (unsigned)(rng() % 65536));
+    }
+}
+
+/*
+  Returns how many of the HASH_KEYS keys land in an already used bucket when bucket[i] is the bucket of key i.
+ */
+static size_t collisions(const size_t *bucket, size_t nbuckets)
+{
+    bool *used = calloc(nbuckets, sizeof(bool));
+    if (used == NULL) error(1, 0, "Allocation failure");
+    size_t n = 0;
+    for (size_t i = 0; i < HASH_KEYS; i++) {
+        n += used[bucket[i]];
+        used[bucket[i]] = true;
+    }
+    free(used);
+    return n;
+}
+
+static volatile size_t hash_sink; // keeps the timed loops from being optimized away
+
+static void bench_hash(size_t n)
+{
+    static const char *what[] = { "hash+index numbered keys", "hash+index file names", "hash+index long paths" };
+    char (*keys)[64] = malloc(HASH_KEYS * sizeof(*keys));
+    size_t *bucket = malloc(HASH_KEYS * sizeof(size_t));
+    if (keys == NULL || bucket == NULL) error(1, 0, "Allocation failure");
+    size_t rounds = n / HASH_KEYS, nbuckets = 2 * HASH_KEYS; // a power of two for the mask, odd for the %
+    unsigned long seed = rng();
+
+    for (int kind = 0; kind < 3; kind++) {
+        make_keys(keys, kind);
+        size_t osum = 0, nsum = 0;
+        double t = now();
+        for (size_t r = 0; r < rounds; r++)
+            for (size_t i = 0; i < HASH_KEYS; i++) osum += roberts_hash(keys[i]) % (nbuckets - 1);
+        double old = now() - t;
+        t = now();
+        for (size_t r = 0; r < rounds; r++)
+            for (size_t i = 0; i < HASH_KEYS; i++) nsum += cmap_hash(keys[i], strlen(keys[i]), seed) & (nbuckets - 1);
+        double elapsed = now() - t;
+
+        // a random function puts HASH_KEYS keys into nbuckets buckets with this many collisions on average
+        double expect = HASH_KEYS - nbuckets * (1 - pow(1 - 1.0 / nbuckets, HASH_KEYS));
+        for (size_t i = 0; i < HASH_KEYS; i++) bucket[i] = cmap_hash(keys[i], strlen(keys[i]), seed) & (nbuckets - 1);
+        size_t got = collisions(bucket, nbuckets);
+        hash_sink = osum + nsum;
+        report(what[kind], rounds * HASH_KEYS, old, elapsed, fabs(got - expect) < 0.05 * expect);
+    }
+    free(keys);
+    free(bucket);
+}
+
+/*
+  Looks up n lines of a newline separated buffer, as read from a file, in a map of long paths: the old way copies each
+  line out to put a NUL after it for cmap_get, the new way passes the line to cmap_get_n where it is.
+ */
+static void bench_slices(size_t n)
+{
+    char (*keys)[64] = malloc(HASH_KEYS * sizeof(*keys));
+    if (keys == NULL) error(1, 0, "Allocation failure");
+    make_keys(keys, 2);
+    CMap *cm = cmap_create(sizeof(size_t), HASH_KEYS, NULL);
+    for (size_t i = 0; i < HASH_KEYS; i++) cmap_put(cm, keys[i], &i);
+
+    size_t nlines = n / 4, len = 0;
+    char *buf = malloc(nlines * 64);
+    if (buf == NULL) error(1, 0, "Allocation failure");
+    for (size_t i = 0; i < nlines; i++) len += sprintf(buf + len, "%s\n", keys[rng() % HASH_KEYS]);
+
+    char line[64];
+    size_t osum = 0, nsum = 0;
+    double t = now();
+    for (char *p = buf, *nl; p < buf + len; p = nl + 1) {
+        nl = memchr(p, '\n', buf + len - p);
+        memcpy(line, p, nl - p);
+        line[nl - p] = '\0';
+        osum += *(size_t *)cmap_get(cm, line);
+    }
+    double old = now() - t;
+    t = now();
+    for (char *p = buf, *nl; p < buf + len; p = nl + 1) {
+        nl = memchr(p, '\n', buf + len - p);
+        nsum += *(size_t *)cmap_get_n(cm, p, nl - p);
+    }
+    report("cmap_get_n on buffer lines", nlines, old, now() - t, osum == nsum);
+    cmap_dispose(cm);
+    free(buf);
+    free(keys);
+}
+
+static void add_value(const char *key, void *value, void *sum)
+{
+    *(size_t *)sum += *(size_t *)value;
+}
+
+/*
+  Dumps every key and value of a map that had n keys put and all but one in 16 removed again: the old way walks the keys
+  with cmap_first/cmap_next and looks each value up with cmap_get, the new way gets both from cmap_for_each.
+ */
+static void bench_dump(size_t n)
+{
+    CMap *cm = cmap_create(sizeof(size_t), 0, NULL);
+    char key[32];
+    for (size_t i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        cmap_put(cm, key, &i);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (i % 16 == 0) continue;
+        snprintf(key, sizeof(key), "key%zu", i);
+        cmap_remove(cm, key);
+    }
+
+    size_t osum = 0, nsum = 0;
+    double t = now();
+    for (const char *k = cmap_first(cm); k != NULL; k = cmap_next(cm, k)) osum += *(size_t *)cmap_get(cm, k);
+    double old = now() - t;
+    t = now();
+    cmap_for_each(cm, add_value, &nsum);
+    report("dump sparse map", cmap_count(cm), old, now() - t, osum == nsum);
+    cmap_dispose(cm);
+}
+
+/*
+  Gets a map of n/4 file paths ready for lookups, the old way by putting every key at startup, the new way by mapping
+  the image cmap_save wrote, then looks every key up in both.
+ */
+static void bench_frozen(size_t n)
+{
+    size_t nkeys = n / 4, osum = 0, nsum = 0;
+    char key[64], path[] = "/tmp/cbench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) error(1, errno, "mkstemp");
+    close(fd);
+
+    double t = now();
+    CMap *live = cmap_create(sizeof(size_t), 0, NULL);
+    for (size_t i = 0; i < nkeys; i++) {
+        snprintf(key, sizeof(key), "/usr/lib/x86_64-linux-gnu/package-%zu/lib.so", i);
+        cmap_put(live, key, &i);
+    }
+    double old = now() - t;
+    if (!cmap_save(live, path)) error(1, errno, "cmap_save %s", path);
+    t = now();
+    CMap *mapped = cmap_open_mapped(path);
+    double elapsed = now() - t;
+    if (mapped == NULL) error(1, errno, "cmap_open_mapped %s", path);
+    unlink(path);
+
+    t = now();
+    for (size_t i = 0; i < nkeys; i++) {
+        snprintf(key, sizeof(key), "/usr/lib/x86_64-linux-gnu/package-%zu/lib.so", i);
+        osum += *(size_t *)cmap_get(live, key);
+    }
+    double oldget = now() - t;
+    t = now();
+    for (size_t i = 0; i < nkeys; i++) {
+        snprintf(key, sizeof(key), "/usr/lib/x86_64-linux-gnu/package-%zu/lib.so", i);
+        nsum += *(size_t *)cmap_get(mapped, key);
+    }
+    bool same = osum == nsum && cmap_count(live) == cmap_count(mapped) && cmap_get(mapped, "/usr/lib") == NULL;
+    report("load map (cmap_open_mapped)", nkeys, old, elapsed, same);
+    report("cmap_get on mapped image", nkeys, oldget, now() - t, same);
+    cmap_dispose(live);
+    cmap_dispose(mapped);
+
+    t = now();
+    live = cmap_create(sizeof(size_t), n, NULL);
+    for (size_t i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "%zu", i);
+        cmap_put(live, key, &i);
+    }
+    old = now() - t;
+    t = now();
+    CMap *frozen = cmap_freeze(live);
+    elapsed = now() - t;
+    cmap_dispose(live);
+    same = frozen != NULL && cmap_count(frozen) == (int)n;
+    for (size_t i = 0; i < n && same; i++) {
+        snprintf(key, sizeof(key), "%zu", i);
+        size_t *v = cmap_get(frozen, key);
+        same = v != NULL && *v == i;
+    }
+    report("cmap_freeze, N keys", n, old, elapsed, same);
+    if (frozen != NULL) cmap_dispose(frozen);
+}
+
+struct pair {
+    long a, b; // always equal in a whole value
+};
+
+struct shared {
+    CMap *locked; // used by the old way, behind lock
+    pthread_mutex_t lock;
+    CCMap *concurrent;
+    int nthreads;
+    size_t ops; // per thread
+    atomic_size_t torn;
+    atomic_size_t puts; // into the CCMap
+};
+
+struct worker {
+    struct shared *sh;
+    int id;
+    pthread_t thread;
+};
+
+static atomic_size_t cleaned, cleaned_torn; // values given to count_cleanup, and the torn ones among them
+
+/*
+  The cleanup function of the CCMap of the concurrent rows.
+ */
+static void count_cleanup(void *addr)
+{
+    const struct pair *v = addr;
+    atomic_fetch_add(&cleaned, 1);
+    if (v->a != v->b) atomic_fetch_add(&cleaned_torn, 1);
+}
+
+/*
+  One thread of a concurrent row: looks up any key and puts or removes only the keys whose number is its id modulo the
+  number of threads, with its own xorshift so each thread does the same operations in both runs.
+ */
+static void *concurrent_worker(void *arg)
+{
+    struct worker *w = arg;
+    struct shared *sh = w->sh;
+    uint64_t state = 0x9e3779b97f4a7c15ULL * (w->id + 1);
+    char key[32];
+    size_t torn = 0, puts = 0;
+    for (size_t i = 0; i < sh->ops; i++) {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        uint64_t r = state * 2685821657736338717ULL;
+        size_t k = (r >> 8) % SHARED_KEYS, op = r % 100;
+        if (op >= 90) k = k / sh->nthreads * sh->nthreads + w->id; // one of its own keys
+        if (k >= SHARED_KEYS) continue;
+        snprintf(key, sizeof(key), "shared%zu", k);
+        struct pair v = { (long)i, (long)i };
+        if (sh->locked != NULL) {
+            pthread_mutex_lock(&sh->lock);
+            if (op < 90) {
+                struct pair *p = cmap_get(sh->locked, key);
+                if (p != NULL) v = *p;
+            }
+            else if (op < 95) cmap_put(sh->locked, key, &v);
+            else cmap_remove(sh->locked, key);
+            pthread_mutex_unlock(&sh->lock);
+        }
+        else {
+            if (op < 90) ccmap_get(sh->concurrent, key, &v);
+            else if (op < 95) {
+                ccmap_put(sh->concurrent, key, &v);
+                puts++;
+            }
+            else ccmap_remove(sh->concurrent, key);
+        }
+        torn += v.a != v.b;
+    }
+    atomic_fetch_add(&sh->torn, torn);
+    atomic_fetch_add(&sh->puts, puts);
+    return NULL;
+}
+
+/*
+  Runs nthreads workers on the map of sh and returns the time they took.
+ */
+static double run_workers(struct shared *sh, int nthreads)
+{
+    struct worker workers[MAX_THREADS];
+    sh->nthreads = nthreads;
+    double t = now();
+    for (int i = 0; i < nthreads; i++) {
+        workers[i] = (struct worker){ sh, i, 0 };
+        if (pthread_create(&workers[i].thread, NULL, concurrent_worker, &workers[i]) != 0) error(1, 0, "pthread_create failed");
+    }
+    for (int i = 0; i < nthreads; i++) pthread_join(workers[i].thread, NULL);
+    return now() - t;
+}
+
+static void bench_concurrent(size_t n)
+{
+    char key[32], what[32];
+    for (int nthreads = 1; nthreads <= MAX_THREADS; nthreads *= 2) {
+        struct shared sh = { .ops = n / 4 / nthreads };
+        atomic_init(&sh.torn, 0);
+        atomic_init(&sh.puts, 0);
+        atomic_store(&cleaned, 0);
+        atomic_store(&cleaned_torn, 0);
+        pthread_mutex_init(&sh.lock, NULL);
+        sh.locked = cmap_create(sizeof(struct pair), 0, NULL);
+        sh.concurrent = ccmap_create(sizeof(struct pair), 0, count_cleanup);
+        size_t stored = 0; // values put into the CCMap, which grows from its default size while it is filled
+        for (size_t k = 0; k < SHARED_KEYS; k += 2) { // start half full
+            struct pair v = { -1, -1 };
+            snprintf(key, sizeof(key), "shared%zu", k);
+            cmap_put(sh.locked, key, &v);
+            ccmap_put(sh.concurrent, key, &v);
+            stored++;
+        }
+
+        double old = run_workers(&sh, nthreads);
+        CMap *locked = sh.locked;
+        sh.locked = NULL;
+        double elapsed = run_workers(&sh, nthreads);
+
+        bool same = atomic_load(&sh.torn) == 0 && cmap_count(locked) == ccmap_count(sh.concurrent);
+        for (const char *k = cmap_first(locked); k != NULL && same; k = cmap_next(locked, k)) {
+            struct pair v;
+            same = ccmap_get(sh.concurrent, k, &v) && memcmp(&v, cmap_get(locked, k), sizeof(v)) == 0;
+        }
+        // a value that left the map is cleaned up at most once, the ones still in it only at dispose
+        stored += atomic_load(&sh.puts);
+        same = same && atomic_load(&cleaned) <= stored - ccmap_count(sh.concurrent);
+        ccmap_dispose(sh.concurrent);
+        same = same && atomic_load(&cleaned) == stored && atomic_load(&cleaned_torn) == 0;
+
+        snprintf(what, sizeof(what), "shared map, %d threads", nthreads);
+        report(what, sh.ops * nthreads, old, elapsed, same);
+        cmap_dispose(locked);
+        pthread_mutex_destroy(&sh.lock);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = (argc > 1) ? strtoul(argv[1], NULL, 10) : DEFAULT_N;
+    if (n < INSERT_N) error(1, 0, "Usage: cbench [N]     (N of at least %d)", INSERT_N);
+
+    printf("%-28s %12s %12s %9s  %s\n", "operation", "old ns", "new ns", "speedup", "check");
+    bench_vector(n);
+    bench_bulk(n);
+    bench_sort(n);
+    bench_search(n);
+    bench_traverse(n);
+    bench_alloc(n);
+    bench_hash(n);
+    bench_slices(n);
+    bench_dump(n);
+    bench_frozen(n);
+    bench_concurrent(n);
+    return nbad ? 1 : 0;
+}
@@ -0,0 +1,450 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "ccmap.h"
+
+#define DEFAULT_CAPACITY 1023
+#define STRIPES 64 // writer locks, the stripe of a key is the low bits of its hash
+#define RECLAIM_BATCH 64 // retired nodes a stripe collects before it tries to free them
+#define CACHE_LINE 64
+
+/*
+  A key value pair. Nodes are never changed once they are reachable: a put of a key already in the map links in a
+  new node in place of the old one, so a reader copying a value never sees half of an update. Unlinked nodes are
+  retired and only freed two epochs later, when no reader can still be looking at them.
+  The value follows the header at a 16 byte boundary, and the key, with a NUL after it, follows the value.
+ */
+struct node {
+  _Atomic(struct node*) next ;
+  unsigned long hash ;
+  size_t len ;
+  struct node *retired ; // next in the retired list of its stripe
+  unsigned long epoch ; // in which it was retired
+};
+
+#define NODE_HDR          ((sizeof(struct node)+15)/16*16)
+#define GET_VAL(n)        ((char*)(n)+NODE_HDR)
+#define GET_KEY(n)        (GET_VAL(n)+cm->elemsz)
+#define NODE_SIZE(cm,len) (NODE_HDR+(cm)->elemsz+(len)+1)
+
+/*
+  A chained table with a power of two number of buckets, so a bucket is a mask of the hash. There are at least
+  STRIPES buckets, so the stripe of a key is also the low bits of its bucket and a stripe guards whole chains.
+ */
+struct table {
+  _Atomic(struct node*) *buckets ;
+  size_t mask ;
+  struct table *retired ; // next in the list of tables replaced by a bigger one
+  unsigned long epoch ; // in which it was replaced
+};
+
+struct stripe {
+  _Alignas(CACHE_LINE) pthread_mutex_t lock ; // a line of its own, so writers of different stripes do not share one
+  struct node *retired ;
+  size_t nretired , reclaim_at ; // reclaim runs when there are reclaim_at retired nodes, RECLAIM_BATCH more than last time
+};
+
+/*
+  Writers lock the stripe of their key, check that the table was not replaced while they waited and change the chain.
+  The table doubles once it holds more keys than buckets: the resizing writer takes every stripe, copies the nodes
+  into the new table and publishes it, and the old table is retired with its nodes.
+ */
+struct ccmap {
+  _Atomic(struct table*) table ;
+  struct stripe stripes[STRIPES] ;
+  pthread_mutex_t tables_lock ; // guards old_tables
+  struct table *old_tables ;
+  atomic_long nelems ;
+  size_t elemsz ;
+  unsigned long seed ;
+  CleanupValueFn cleanup ;
+};
+
+/*
+  Epoch based reclamation, shared by every CCMap. Each thread that uses a map gets a reader record, which holds the
+  global epoch it saw when it entered its current operation, or 0 outside of one. The global epoch only moves on
+  once every thread inside an operation has seen it, so two moves after a node is unlinked nobody can still hold it.
+  Records are taken over by new threads once the thread that had one exits, and are never freed.
+ */
+struct reader {
+  _Alignas(CACHE_LINE) atomic_ulong state ; // the epoch shifted left once plus 1 inside an operation, else 0
+  atomic_bool used ;
+  unsigned depth ; // of nested operations, a cleanup function may use another map
+  struct reader *next ;
+};
+
+static _Atomic(struct reader*) readers ;
+static atomic_ulong global_epoch = 1 ;
+static _Thread_local struct reader *self ;
+static pthread_key_t reader_key ;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT ;
+
+static void release_reader(void *r)
+{
+  atomic_store(&((struct reader*)r)->used , false) ;
+}
+
+static void make_reader_key(void)
+{
+  pthread_key_create(&reader_key , release_reader) ;
+}
+
+/*
+  Returns the reader record of the calling thread, taking a free one or adding one the first time.
+ */
+static struct reader *get_reader(void)
+{
+  if(self != NULL) return self ;
+  pthread_once(&reader_once , make_reader_key) ;
+  for(struct reader *r = atomic_load(&readers) ; r != NULL && self == NULL ; r = r->next){
+    bool no = false ;
+    if(atomic_compare_exchange_strong(&r->used , &no , true)) self = r ;
+  }
+  if(self == NULL){
+    struct reader *r = aligned_alloc(CACHE_LINE , sizeof(struct reader)) ;
+    if(r == NULL) assert("Allocation failure") ;
+    memset(r , 0 , sizeof(struct reader)) ;
+    atomic_store(&r->used , true) ;
+    r->next = atomic_load(&readers) ;
+    while(!atomic_compare_exchange_weak(&readers , &r->next , r)) ;
+    self = r ;
+  }
+  pthread_setspecific(reader_key , self) ;
+  return self ;
+}
+
+static void enter(void)
+{
+  struct reader *r = get_reader() ;
+  if(r->depth++ == 0){
+    unsigned long e = atomic_load_explicit(&global_epoch , memory_order_relaxed) ;
+    atomic_store_explicit(&r->state , (e << 1) | 1 , memory_order_relaxed) ;
+    atomic_thread_fence(memory_order_seq_cst) ; // the state is visible before any node is read
+  }
+}
+
+static void leave(void)
+{
+  struct reader *r = self ;
+  if(--r->depth == 0) atomic_store_explicit(&r->state , 0 , memory_order_release) ;
+}
+
+/*
+  Moves the global epoch on if every thread inside an operation has seen it, and returns the global epoch.
+ */
+static unsigned long try_advance(void)
+{
+  unsigned long e = atomic_load(&global_epoch) ;
+  atomic_thread_fence(memory_order_seq_cst) ;
+  for(struct reader *r = atomic_load(&readers) ; r != NULL ; r = r->next){
+    unsigned long s = atomic_load(&r->state) ;
+    if((s & 1) && (s >> 1) != e) return e ;
+  }
+  if(atomic_compare_exchange_strong(&global_epoch , &e , e+1)) return e+1 ;
+  return e ; // somebody else moved it, e was updated
+}
+
+/*
+  Frees a node, calling the cleanup function on its value unless the value was copied into a new table.
+ */
+static void free_node(CCMap *cm, struct node *n, bool cleanup)
+{
+  if(cleanup && cm->cleanup != NULL) cm->cleanup(GET_VAL(n)) ;
+  free(n) ;
+}
+
+/*
+  Frees a table and the nodes still on its chains, whose values live on in the table that replaced it.
+ */
+static void free_table(CCMap *cm, struct table *t, bool cleanup)
+{
+  for(size_t b = 0 ; b <= t->mask ; b++){
+    for(struct node *n = atomic_load_explicit(&t->buckets[b] , memory_order_relaxed) , *next ; n != NULL ; n = next){
+      next = atomic_load_explicit(&n->next , memory_order_relaxed) ;
+      free_node(cm , n , cleanup) ;
+    }
+  }
+  free(t->buckets) ;
+  free(t) ;
+}
+
+static struct table *alloc_table(size_t nbuckets)
+{
+  struct table *t = calloc(1 , sizeof(struct table)) ;
+  if(t == NULL) assert("Allocation failure") ;
+  t->buckets = calloc(nbuckets , sizeof(*t->buckets)) ;
+  if(t->buckets == NULL) assert("Allocation failure") ;
+  t->mask = nbuckets-1 ;
+  return t ;
+}
+
+/*
+  Frees the replaced tables of cm that no reader can hold any more at epoch e. tables_lock is held.
+ */
+static void free_old_tables(CCMap *cm, unsigned long e)
+{
+  for(struct table **link = &cm->old_tables , *t ; (t = *link) != NULL ; ){
+    if(t->epoch+2 <= e){
+      *link = t->retired ;
+      free_table(cm , t , false) ;
+    }
+    else link = &t->retired ;
+  }
+}
+
+/*
+  Frees the retired nodes of a stripe, whose lock is held, that no reader can hold any more,
+  and the replaced tables too unless another writer is at it.
+ */
+static void reclaim(CCMap *cm, struct stripe *st)
+{
+  unsigned long e = try_advance() ;
+  for(struct node **link = &st->retired , *n ; (n = *link) != NULL ; ){
+    if(n->epoch+2 <= e){
+      *link = n->retired ;
+      free_node(cm , n , true) ;
+      st->nretired-- ;
+    }
+    else link = &n->retired ;
+  }
+  if(pthread_mutex_trylock(&cm->tables_lock) == 0){
+    free_old_tables(cm , e) ;
+    pthread_mutex_unlock(&cm->tables_lock) ;
+  }
+}
+
+static void retire(CCMap *cm, struct stripe *st, struct node *n)
+{
+  atomic_thread_fence(memory_order_seq_cst) ; // the unlink is visible before the epoch is read
+  n->epoch = atomic_load(&global_epoch) ;
+  n->retired = st->retired ;
+  st->retired = n ;
+  if(++st->nretired >= st->reclaim_at){
+    reclaim(cm , st) ;
+    st->reclaim_at = st->nretired+RECLAIM_BATCH ;
+  }
+}
+
+/*
+  Locks the stripe st and returns the table of cm, which cannot be replaced until st is unlocked.
+ */
+static struct table *lock_table(CCMap *cm, struct stripe *st)
+{
+  while(1){
+    struct table *t = atomic_load_explicit(&cm->table , memory_order_acquire) ;
+    pthread_mutex_lock(&st->lock) ;
+    if(t == atomic_load_explicit(&cm->table , memory_order_relaxed)) return t ;
+    pthread_mutex_unlock(&st->lock) ; // resized while we waited
+  }
+}
+
+/*
+  Takes as input a CCMap (cm), a table (t) whose stripe for h is locked, a key (key) of len bytes and its hash (h) and
+  returns the link pointing at the node of key, or NULL if key is not in the table.
+ */
+static _Atomic(struct node*) *find_link(const CCMap *cm, struct table *t, const char *key, size_t len, unsigned long h)
+{
+  _Atomic(struct node*) *link = &t->buckets[h & t->mask] ;
+  for(struct node *n ; (n = atomic_load_explicit(link , memory_order_relaxed)) != NULL ; link = &n->next){
+    if(n->hash == h && n->len == len && memcmp(GET_KEY(n) , key , len) == 0) return link ;
+  }
+  return NULL ;
+}
+
+/*
+  Doubles the table t of cm, unless another writer already replaced it. Every stripe is locked meanwhile,
+  readers go on using t until the new table is published.
+ */
+static void resize(CCMap *cm, struct table *t)
+{
+  for(int i = 0 ; i < STRIPES ; i++) pthread_mutex_lock(&cm->stripes[i].lock) ;
+  if(atomic_load_explicit(&cm->table , memory_order_relaxed) == t){
+    struct table *nt = alloc_table(2*(t->mask+1)) ;
+    for(size_t b = 0 ; b <= t->mask ; b++){
+      for(struct node *n = atomic_load_explicit(&t->buckets[b] , memory_order_relaxed) ; n != NULL ;
+          n = atomic_load_explicit(&n->next , memory_order_relaxed)){
+        struct node *copy = malloc(NODE_SIZE(cm , n->len)) ;
+        if(copy == NULL) assert("Allocation failure") ;
+        memcpy(copy , n , NODE_SIZE(cm , n->len)) ;
+        _Atomic(struct node*) *head = &nt->buckets[n->hash & nt->mask] ;
+        atomic_store_explicit(&copy->next , atomic_load_explicit(head , memory_order_relaxed) , memory_order_relaxed) ;
+        atomic_store_explicit(head , copy , memory_order_relaxed) ;
+      }
+    }
+    atomic_store_explicit(&cm->table , nt , memory_order_release) ;
+
+    atomic_thread_fence(memory_order_seq_cst) ;
+    t->epoch = atomic_load(&global_epoch) ;
+    pthread_mutex_lock(&cm->tables_lock) ;
+    t->retired = cm->old_tables ;
+    cm->old_tables = t ;
+    free_old_tables(cm , try_advance()) ; // the smaller ones, when nothing is removed reclaim never runs
+    pthread_mutex_unlock(&cm->tables_lock) ;
+  }
+  for(int i = STRIPES-1 ; i >= 0 ; i--) pthread_mutex_unlock(&cm->stripes[i].lock) ;
+}
+
+/*
+  Takes as input the size of the values (valuesz), the predicted number of keys (capacity_hint) and a cleanup function
+  for the values or NULL, like cmap_create, and returns an empty CCMap.
+ */
+CCMap *ccmap_create(size_t valuesz, size_t capacity_hint, CleanupValueFn fn)
+{
+  if(valuesz == 0) assert("0 value size") ;
+  CCMap *cm = aligned_alloc(CACHE_LINE , (sizeof(CCMap)+CACHE_LINE-1)/CACHE_LINE*CACHE_LINE) ;
+  if(cm == NULL) assert("Allocation failure") ;
+  memset(cm , 0 , sizeof(CCMap)) ;
+  cm->elemsz = valuesz ;
+  cm->cleanup = fn ;
+  cm->seed = cmap_hash((const char*)&cm , sizeof(cm) , (unsigned long)time(NULL)) ;
+  for(int i = 0 ; i < STRIPES ; i++){
+    pthread_mutex_init(&cm->stripes[i].lock , NULL) ;
+    cm->stripes[i].reclaim_at = RECLAIM_BATCH ;
+  }
+  pthread_mutex_init(&cm->tables_lock , NULL) ;
+
+  if(capacity_hint == 0) capacity_hint = DEFAULT_CAPACITY ;
+  size_t nbuckets = STRIPES ;
+  while(nbuckets < capacity_hint) nbuckets *= 2 ;
+  atomic_store(&cm->table , alloc_table(nbuckets)) ;
+  return cm ;
+}
+
+/*
+  Takes as input a CCMap (cm) and frees it along with every key and value, calling the cleanup function on the values.
+  No other thread may be using the map.
+ */
+void ccmap_dispose(CCMap *cm)
+{
+  free_table(cm , atomic_load(&cm->table) , true) ;
+  for(struct table *t = cm->old_tables , *next ; t != NULL ; t = next){
+    next = t->retired ;
+    free_table(cm , t , false) ;
+  }
+  for(int i = 0 ; i < STRIPES ; i++){
+    for(struct node *n = cm->stripes[i].retired , *next ; n != NULL ; n = next){
+      next = n->retired ;
+      free_node(cm , n , true) ;
+    }
+    pthread_mutex_destroy(&cm->stripes[i].lock) ;
+  }
+  pthread_mutex_destroy(&cm->tables_lock) ;
+  free(cm) ;
+}
+
+/*
+  Takes as input a CCMap (cm) and returns the number of keys in it, which other threads may be changing.
+ */
+int ccmap_count(const CCMap *cm)
+{
+  return (int)atomic_load(&((CCMap*)cm)->nelems) ;
+}
+
+/*
+  Takes as input a CCMap (cm), a string (key) and the address of a value (addr) and associates a copy of the value
+  with the key, replacing the value it had. The cleanup function of a replaced value is called once no reader
+  can be copying it any more, which may be during a later call.
+ */
+void ccmap_put(CCMap *cm, const char *key, const void *addr)
+{
+  ccmap_put_n(cm , key , strlen(key) , addr) ;
+}
+
+/*
+  Same as ccmap_put, except that the key is the len bytes at key, which need not be followed by a NUL.
+ */
+void ccmap_put_n(CCMap *cm, const char *key, size_t len, const void *addr)
+{
+  unsigned long h = cmap_hash(key , len , cm->seed) ;
+  struct node *n = malloc(NODE_SIZE(cm , len)) ; // built before taking the lock
+  if(n == NULL) assert("Allocation failure") ;
+  n->hash = h ;
+  n->len = len ;
+  memcpy(GET_VAL(n) , addr , cm->elemsz) ;
+  memcpy(GET_KEY(n) , key , len) ;
+  GET_KEY(n)[len] = '\0' ;
+
+  struct stripe *st = &cm->stripes[h % STRIPES] ;
+  bool grow = false ;
+  enter() ;
+  struct table *t = lock_table(cm , st) ;
+  _Atomic(struct node*) *link = find_link(cm , t , key , len , h) ;
+  if(link != NULL){ // replace the node
+    struct node *old = atomic_load_explicit(link , memory_order_relaxed) ;
+    atomic_store_explicit(&n->next , atomic_load_explicit(&old->next , memory_order_relaxed) , memory_order_relaxed) ;
+    atomic_store_explicit(link , n , memory_order_release) ;
+    retire(cm , st , old) ;
+  }
+  else{
+    _Atomic(struct node*) *head = &t->buckets[h & t->mask] ;
+    atomic_store_explicit(&n->next , atomic_load_explicit(head , memory_order_relaxed) , memory_order_relaxed) ;
+    atomic_store_explicit(head , n , memory_order_release) ;
+    grow = atomic_fetch_add(&cm->nelems , 1)+1 > (long)(t->mask+1) ;
+  }
+  pthread_mutex_unlock(&st->lock) ;
+  if(grow) resize(cm , t) ;
+  leave() ;
+}
+
+/*
+  Takes as input a CCMap (cm), a string (key) and the address of a buffer of the value size (out). Copies the value
+  associated with key into out and returns true, or returns false if key is not in the map. Takes no lock.
+ */
+bool ccmap_get(const CCMap *cm, const char *key, void *out)
+{
+  return ccmap_get_n(cm , key , strlen(key) , out) ;
+}
+
+/*
+  Same as ccmap_get, except that the key is the len bytes at key, which need not be followed by a NUL.
+ */
+bool ccmap_get_n(const CCMap *cm, const char *key, size_t len, void *out)
+{
+  unsigned long h = cmap_hash(key , len , cm->seed) ;
+  bool found = false ;
+  enter() ;
+  struct table *t = atomic_load_explicit(&((CCMap*)cm)->table , memory_order_acquire) ;
+  for(struct node *n = atomic_load_explicit(&t->buckets[h & t->mask] , memory_order_acquire) ; n != NULL ;
+      n = atomic_load_explicit(&n->next , memory_order_acquire)){
+    if(n->hash == h && n->len == len && memcmp(GET_KEY(n) , key , len) == 0){
+      memcpy(out , GET_VAL(n) , cm->elemsz) ;
+      found = true ;
+      break ;
+    }
+  }
+  leave() ;
+  return found ;
+}
+
+/*
+  Takes as input a CCMap (cm) and a string (key) and removes key and its value from the map. The cleanup function
+  of the value is called once no reader can be copying it any more.
+ */
+void ccmap_remove(CCMap *cm, const char *key)
+{
+  ccmap_remove_n(cm , key , strlen(key)) ;
+}
+
+/*
+  Same as ccmap_remove, except that the key is the len bytes at key, which need not be followed by a NUL.
+ */
+void ccmap_remove_n(CCMap *cm, const char *key, size_t len)
+{
+  unsigned long h = cmap_hash(key , len , cm->seed) ;
+  struct stripe *st = &cm->stripes[h % STRIPES] ;
+  enter() ;
+  struct table *t = lock_table(cm , st) ;
+  _Atomic(struct node*) *link = find_link(cm , t , key , len , h) ;
+  if(link != NULL){
+    struct node *n = atomic_load_explicit(link , memory_order_relaxed) ;
+    atomic_store_explicit(link , atomic_load_explicit(&n->next , memory_order_relaxed) , memory_order_release) ;
+    atomic_fetch_sub(&cm->nelems , 1) ;
+    retire(cm , st , n) ;
+  }
+  pthread_mutex_unlock(&st->lock) ;
+  leave() ;
+}
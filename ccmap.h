@@ -0,0 +1,26 @@
+#ifndef _ccmap_h
+#define _ccmap_h
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "cmap.h"
+
+/*
+  CCMap is a CMap that can be used from many threads at once. Writers lock one of a set of stripes,
+  readers take no lock and never wait. Since a value can be replaced or removed while it is being read,
+  ccmap_get copies the value out instead of returning its address.
+  See ccmap.c for the description of each function.
+ */
+typedef struct ccmap CCMap;
+
+CCMap *ccmap_create(size_t valuesz, size_t capacity_hint, CleanupValueFn fn);
+void ccmap_dispose(CCMap *cm);
+int ccmap_count(const CCMap *cm);
+void ccmap_put(CCMap *cm, const char *key, const void *addr);
+bool ccmap_get(const CCMap *cm, const char *key, void *out);
+void ccmap_remove(CCMap *cm, const char *key);
+void ccmap_put_n(CCMap *cm, const char *key, size_t len, const void *addr);
+bool ccmap_get_n(const CCMap *cm, const char *key, size_t len, void *out);
+void ccmap_remove_n(CCMap *cm, const char *key, size_t len);
+
+#endif
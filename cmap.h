@@ -0,0 +1,39 @@
+#ifndef _cmap_h
+#define _cmap_h
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "allocator.h"
+
+/*
+  CMap associates string keys with values of a fixed size (valuesz) that are copied into the map.
+  See map.c for the description of each function.
+ */
+typedef void (*CleanupValueFn)(void *addr);
+typedef void (*VisitPairFn)(const char *key, void *value, void *aux);
+
+typedef struct map CMap;
+
+// bytes of the block holding a key of keylen bytes and its value, what a CPool for a map's cells should be sized for
+#define CMAP_CELL_SIZE(valuesz, keylen) \
+  (((valuesz)+sizeof(size_t)-1)/sizeof(size_t)*sizeof(size_t)+2*sizeof(char*)+sizeof(size_t)+(keylen)+1)
+
+CMap *cmap_create(size_t valuesz, size_t capacity_hint, CleanupValueFn fn);
+CMap *cmap_create_with(size_t valuesz, size_t capacity_hint, CleanupValueFn fn, const CAllocator *alloc);
+void cmap_dispose(CMap *cm);
+int cmap_count(const CMap *cm);
+void cmap_put(CMap *cm, const char *key, const void *addr);
+void *cmap_get(const CMap *cm, const char *key);
+void cmap_remove(CMap *cm, const char *key);
+void cmap_put_n(CMap *cm, const char *key, size_t len, const void *addr);
+void *cmap_get_n(const CMap *cm, const char *key, size_t len);
+void cmap_remove_n(CMap *cm, const char *key, size_t len);
+const char *cmap_first(const CMap *cm);
+const char *cmap_next(const CMap *cm, const char *prevkey);
+void cmap_for_each(const CMap *cm, VisitPairFn fn, void *aux);
+CMap *cmap_freeze(const CMap *cm);
+bool cmap_save(const CMap *cm, const char *path);
+CMap *cmap_open_mapped(const char *path);
+unsigned long cmap_hash(const char *key, size_t len, unsigned long seed);
+
+#endif
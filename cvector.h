@@ -0,0 +1,261 @@
+#ifndef _cvector_h
+#define _cvector_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "allocator.h"
+
+/*
+  CVector is a growable array of elements of a fixed size (elemsz) that are copied into the vector.
+  See vector.c for the description of each function.
+ */
+typedef void (*CleanupElemFn)(void *addr);
+typedef int (*CompareFn)(const void *addr1, const void *addr2);
+typedef void (*VisitElemFn)(void *addr, void *aux);
+typedef void (*FoldElemFn)(void *result, const void *addr, void *aux);
+typedef void (*MergeResultFn)(void *result, const void *partial, void *aux);
+
+typedef struct vec CVector;
+
+/*
+  The key cvec_sort_radix sorts by: the width bytes (1, 2, 4 or 8) at offset in each element, read in the host's byte order
+  as an unsigned or signed integer, or as a float or double.
+ */
+enum cvec_key_type { CVEC_KEY_UNSIGNED, CVEC_KEY_SIGNED, CVEC_KEY_FLOAT };
+
+typedef struct {
+  size_t offset, width;
+  enum cvec_key_type type;
+} CVecKey;
+
+CVector *cvec_create(size_t elemsz, size_t capacity_hint, CleanupElemFn fn);
+CVector *cvec_create_with(size_t elemsz, size_t capacity_hint, CleanupElemFn fn, const CAllocator *alloc);
+void cvec_dispose(CVector *cv);
+int cvec_count(const CVector *cv);
+size_t cvec_capacity(const CVector *cv);
+void *cvec_nth(const CVector *cv, int index);
+void cvec_insert(CVector *cv, const void *addr, int index);
+void cvec_append(CVector *cv, const void *addr);
+void cvec_append_n(CVector *cv, const void *addr, size_t n);
+void cvec_insert_range(CVector *cv, const void *addr, size_t n, int index);
+void cvec_replace(CVector *cv, const void *addr, int index);
+void cvec_remove(CVector *cv, int index);
+void cvec_remove_range(CVector *cv, int index, size_t n);
+void cvec_reserve(CVector *cv, size_t n);
+void cvec_shrink_to_fit(CVector *cv);
+void cvec_set_growth(CVector *cv, double factor);
+int cvec_search(const CVector *cv, const void *key, CompareFn cmp, int start, bool sorted);
+void cvec_sort(CVector *cv, CompareFn cmp);
+void cvec_sort_radix(CVector *cv, const CVecKey *key);
+void cvec_sort_parallel(CVector *cv, CompareFn cmp, int nthreads);
+
+typedef struct vecindex CVecIndex;
+
+CVecIndex *cvec_index_create(const CVector *cv, CompareFn cmp);
+void cvec_index_dispose(CVecIndex *ix);
+int cvec_index_search(const CVecIndex *ix, const void *key);
+void cvec_index_search_n(const CVecIndex *ix, const void *keys, size_t nkeys, int *results);
+void *cvec_first(const CVector *cv);
+void *cvec_next(const CVector *cv, const void *prev);
+void cvec_for_each(const CVector *cv, VisitElemFn fn, void *aux);
+void cvec_parallel_for(const CVector *cv, VisitElemFn fn, void *aux);
+void cvec_reduce(const CVector *cv, void *result, size_t resultsz, FoldElemFn fold, MergeResultFn merge, void *aux);
+
+#define CVEC_DEFAULT_CAPACITY 16
+#define CVEC_DEFAULT_GROWTH 2.0
+
+/*
+  CVEC_DEFINE(T) generates CVector_T, a vector of T, and the functions cvec_T_create, cvec_T_nth, cvec_T_append...
+  with the same behavior as their cvec_ counterparts, except that elements are passed and stored by value.
+  That includes the growth factor (cvec_T_set_growth) and the allocator (cvec_T_create_with).
+  The element size is known at compile time and elements are copied by assignment, so the functions are
+  static inline and the compiler can inline and vectorize the loops that use them.
+  CVEC_DEFINE_NAMED(name, T) does the same for types whose name is not a single word (CVEC_DEFINE_NAMED(ulong, unsigned long)).
+  The cleanup function and comparators take pointers to elements, like the ones of CVector.
+ */
+#define CVEC_DEFINE(T) CVEC_DEFINE_NAMED(T, T)
+
+#define CVEC_DEFINE_NAMED(name, T)                                                                                  \
+  typedef struct {                                                                                                 \
+    T *elements;                                                                                                   \
+    size_t nelems, space;                                                                                          \
+    CleanupElemFn cleanup;                                                                                         \
+    double growth;                                                                                                 \
+    CAllocator alloc;                                                                                              \
+  } CVector_##name;                                                                                                \
+                                                                                                                   \
+  static inline CVector_##name *cvec_##name##_create_with(size_t capacity_hint, CleanupElemFn fn,                  \
+                                                         const CAllocator *alloc){                                 \
+    if(capacity_hint == 0) capacity_hint = CVEC_DEFAULT_CAPACITY;                                                  \
+    CVector_##name *vec = alloc->alloc(alloc->ctx, sizeof(CVector_##name));                                        \
+    if(vec == NULL) assert("Allocation failure");                                                                  \
+    memset(vec, 0, sizeof(CVector_##name));                                                                        \
+    vec->alloc = *alloc;                                                                                           \
+    vec->elements = alloc->alloc(alloc->ctx, sizeof(T)*capacity_hint);                                             \
+    if(vec->elements == NULL) assert("Allocation failure");                                                        \
+    vec->space = capacity_hint;                                                                                    \
+    vec->growth = CVEC_DEFAULT_GROWTH;                                                                             \
+    vec->cleanup = fn;                                                                                             \
+    return vec;                                                                                                    \
+  }                                                                                                                \
+                                                                                                                   \
+  static inline CVector_##name *cvec_##name##_create(size_t capacity_hint, CleanupElemFn fn){                      \
+    return cvec_##name##_create_with(capacity_hint, fn, &callocator_heap);                                         \
+  }                                                                                                                \
+                                                                                                                   \
+  static inline void cvec_##name##_dispose(CVector_##name *cv){                                                    \
+    if(cv->cleanup != NULL){                                                                                       \
+      for(size_t x = 0; x < cv->nelems; x++) cv->cleanup(&cv->elements[x]);                                        \
+    }                                                                                                              \
+    CAllocator alloc = cv->alloc;                                                                                  \
+    alloc.free(alloc.ctx, cv->elements, cv->space*sizeof(T));                                                      \
+    alloc.free(alloc.ctx, cv, sizeof(CVector_##name));                                                             \
+  }                                                                                                                \
+                                                                                                                   \
+  static inline int cvec_##name##_count(const CVector_##name *cv){                                                 \
+    return (int)cv->nelems;                                                                                        \
+  }                                                                                                                \
+                                                                                                                   \
+  static inline T *cvec_##name##_nth(const CVector_##name *cv, int index){                                         \
+    if(index < 0 || (size_t)index >= cv->nelems) assert("Invalid index");                                          \
+    return &cv->elements[index];                                                                                   \
+  }                                                                                                                \
+                                                                                                                   \
+  static inline void cvec_##name##_grow(CVector_##name *cv){                                                       \
+    size_t space = (size_t)(cv->space*cv->growth);                                                                 \
+    if(space <= cv->space) space = cv->space+1; /* a growth factor close to 1 on a small vector */                 \
+    T *temp = cv->alloc.realloc(cv->alloc.ctx, cv->elements, cv->space*sizeof(T), space*sizeof(T));                \
+    if(temp == NULL) assert("Allocation failure");                                                                 \
+    cv->elements = temp;                                                                                           \
+    cv->space = space;                                                                                             \
+  }                                                                                                                \
+                                                                                                                   \
+  static inline void cvec_##name##_set_growth(CVector_##name *cv, double factor){                                  \
+    if(!(factor > 1)) assert("Invalid growth factor");                                                             \
+    cv->growth = factor;                                                                                           \
+  }                                                                                                                \
+                                                                                                                   \
+  static inline void cvec_##name##_insert(CVector_##name *cv, T value, int index){                                 \
+    if(index < 0 || (size_t)index > cv->nelems) assert("Invalid index");                                           \
+    if(cv->space == cv->nelems) cvec_##name##_grow(cv);                                                            \
+    memmove(&cv->elements[index+1], &cv->elements[index], sizeof(T)*(cv->nelems-index));                           \
+    cv->elements[index] = value;                                                                                   \
+    cv->nelems++;                                                                                                  \
+  }                                                                                                                \
+                                                                                                                   \
+  static inline void cvec_##name##_append(CVector_##name *cv, T value){                                            \
+    if(cv->space == cv->nelems) cvec_##name##_grow(cv);                                                            \
+    cv->elements[cv->nelems++] = value;                                                                            \
+  }                                                                                                                \
+                                                                                                                   \
+  static inline void cvec_##name##_replace(CVector_##name *cv, T value, int index){                                \
+    if(index < 0 || (size_t)index >= cv->nelems) assert("Invalid index");                                          \
+    if(cv->cleanup != NULL) cv->cleanup(&cv->elements[index]);                                                     \
+    cv->elements[index] = value;                                                                                   \
+  }                                                                                                                \
+                                                                                                                   \
+  static inline void cvec_##name##_remove(CVector_##name *cv, int index){                                          \
+    if(index < 0 || (size_t)index >= cv->nelems) assert("Invalid index");                                          \
+    if(cv->cleanup != NULL) cv->cleanup(&cv->elements[index]);                                                     \
+    memmove(&cv->elements[index], &cv->elements[index+1], sizeof(T)*(cv->nelems-index-1));                         \
+    cv->nelems--;                                                                                                  \
+  }                                                                                                                \
+                                                                                                                   \
+  /* returns the index of the first element at or after start equal to key according to cmp, or -1 */              \
+  static inline int cvec_##name##_search(const CVector_##name *cv, T key, int (*cmp)(const T *, const T *),        \
+                                         int start, bool sorted){                                                  \
+    if(start < 0 || (size_t)start > cv->nelems) assert("Invalid start index");                                     \
+    size_t lo = start, hi = cv->nelems;                                                                            \
+    if(!sorted){                                                                                                   \
+      for(; lo < hi; lo++) if(cmp(&cv->elements[lo], &key) == 0) return (int)lo;                                   \
+      return -1;                                                                                                   \
+    }                                                                                                              \
+    while(lo < hi){ /* lower bound, the first of a run of equal elements */                                        \
+      size_t mid = lo+(hi-lo)/2;                                                                                   \
+      if(cmp(&cv->elements[mid], &key) < 0) lo = mid+1;                                                            \
+      else hi = mid;                                                                                               \
+    }                                                                                                              \
+    return (lo < cv->nelems && cmp(&cv->elements[lo], &key) == 0) ? (int)lo : -1;                                  \
+  }                                                                                                                \
+                                                                                                                   \
+  static inline void cvec_##name##_sort(CVector_##name *cv, int (*cmp)(const T *, const T *)){                     \
+    qsort(cv->elements, cv->nelems, sizeof(T), (CompareFn)cmp);                                                    \
+  }                                                                                                                \
+                                                                                                                   \
+  static inline T *cvec_##name##_first(const CVector_##name *cv){                                                  \
+    return cv->elements;                                                                                           \
+  }                                                                                                                \
+                                                                                                                   \
+  static inline T *cvec_##name##_next(const CVector_##name *cv, const T *prev){                                    \
+    if(prev == &cv->elements[cv->nelems-1]) return NULL;                                                           \
+    return (T *)prev+1;                                                                                            \
+  }
+
+/*
+  CVEC_DEFINE_SORT(name, T, less) generates cvec_name_sort_intro for a vector made by CVEC_DEFINE_NAMED(name, T):
+  an introsort (quicksort with a median of three pivot, heapsort when the recursion gets too deep and insertion sort
+  for short ranges) that compares with less(a, b), a function or macro taking two T values and true if a goes before b.
+  less is called directly, so unlike the comparator of qsort it is inlined.
+ */
+#define CVEC_DEFINE_SORT(name, T, less)                                                                             \
+  static inline void cvec_##name##_sift_down(T *a, size_t root, size_t n){                                         \
+    T value = a[root];                                                                                             \
+    for(size_t child; (child = 2*root+1) < n; root = child){                                                       \
+      if(child+1 < n && less(a[child], a[child+1])) child++;                                                       \
+      if(!less(value, a[child])) break;                                                                            \
+      a[root] = a[child];                                                                                          \
+    }                                                                                                              \
+    a[root] = value;                                                                                               \
+  }                                                                                                                \
+                                                                                                                   \
+  static void cvec_##name##_introsort(T *a, size_t n, int depth){                                                  \
+    while(n > 16){                                                                                                 \
+      if(depth-- == 0){ /* quicksort is going quadratic, heapsort what is left */                                  \
+        for(size_t x = n/2; x-- > 0;) cvec_##name##_sift_down(a, x, n);                                             \
+        for(size_t x = n-1; x > 0; x--){                                                                           \
+          T top = a[0]; a[0] = a[x]; a[x] = top;                                                                   \
+          cvec_##name##_sift_down(a, 0, x);                                                                        \
+        }                                                                                                          \
+        return;                                                                                                    \
+      }                                                                                                            \
+      T *mid = a+n/2, *last = a+n-1, swap;                                                                         \
+      if(less(*mid, *a)){ swap = *mid; *mid = *a; *a = swap; } /* order a[0] <= a[n/2] <= a[n-1] */                \
+      if(less(*last, *mid)){ swap = *last; *last = *mid; *mid = swap; }                                            \
+      if(less(*mid, *a)){ swap = *mid; *mid = *a; *a = swap; }                                                     \
+      T pivot = *mid;                                                                                              \
+      size_t i = 0, j = n-1;                                                                                       \
+      while(1){ /* Hoare partition, the ordered ends keep both scans in bounds */                                  \
+        while(less(a[i], pivot)) i++;                                                                              \
+        while(less(pivot, a[j])) j--;                                                                              \
+        if(i >= j) break;                                                                                          \
+        swap = a[i]; a[i] = a[j]; a[j] = swap;                                                                     \
+        i++; j--;                                                                                                  \
+      }                                                                                                            \
+      size_t nleft = j+1;                                                                                          \
+      if(nleft < n-nleft){ /* recurse on the smaller side, loop on the larger one */                               \
+        cvec_##name##_introsort(a, nleft, depth);                                                                  \
+        a += nleft;                                                                                                \
+        n -= nleft;                                                                                                \
+      }else{                                                                                                       \
+        cvec_##name##_introsort(a+nleft, n-nleft, depth);                                                          \
+        n = nleft;                                                                                                 \
+      }                                                                                                            \
+    }                                                                                                              \
+    for(size_t x = 1; x < n; x++){                                                                                 \
+      T value = a[x];                                                                                              \
+      size_t y = x;                                                                                                \
+      for(; y > 0 && less(value, a[y-1]); y--) a[y] = a[y-1];                                                      \
+      a[y] = value;                                                                                                \
+    }                                                                                                              \
+  }                                                                                                                \
+                                                                                                                   \
+  static inline void cvec_##name##_sort_intro(CVector_##name *cv){                                                 \
+    int depth = 0;                                                                                                 \
+    for(size_t n = cv->nelems; n > 1; n >>= 1) depth += 2;                                                         \
+    cvec_##name##_introsort(cv->elements, cv->nelems, depth);                                                      \
+  }
+
+#endif
@@ -0,0 +1,282 @@
+/*
+  Throughput and regression benchmark for mygrep's matcher.
+
+  Generates deterministic corpora (log-like text, very long lines, and inputs built to make a backtracking matcher
+  blow up), then for a fixed set of patterns reports MB/s and matching lines/s through grep_buffer, plus the worst
+  time spent on a single line by search. Every result is also checked line by line against an oracle,
+  the original backtracking matcher computed without recursion, so a faster engine can be validated before it replaces the current one.
+
+  Build: gcc -O2 -pthread -o grepbench grepbench.c
+  Usage: grepbench [MB]     (size of each corpus, 32 by default)
+  Exits with status 1 if any line disagrees with the oracle.
+ */
+#define MYGREP_NO_MAIN
+#include "mygrep.c"
+
+#define DEFAULT_CORPUS_MB 32
+
+struct corpus {
+    const char *name;
+    char *buf;
+    size_t len;
+};
+
+struct bench {
+    const char *corpus, *pattern;
+};
+
+/*
+  The patterns timed on each corpus. The adversarial ones are exponential for a backtracking matcher.
+ */
+static const struct bench benches[] = {
+    { "log", "ERROR.*timeout" },
+    { "log", "user=4.*latency=9" },
+    { "log", "^2026-10-17T03" },
+    { "log", "request" },
+    { "log", "no such text" },
+    { "log", "W.*N.*g" },
+    { "long", "\"id\":12345" },
+    { "long", "\"tag\":\"z.*q\"" },
+    { "long", ".*" },
+    { "adversarial", "a*a*a*a*a*a*a*a*b" },
+    { "adversarial", ".*.*.*.*.*.*=" },
+    { "adversarial", "^a*a*a*a*c" },
+};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+/*
+  xorshift64*, seeded with a constant so every run generates the same corpora.
+ */
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static void corpus_append(struct corpus *c, size_t space, const char *s, size_t n)
+{
+    if (c->len + n > space) n = space - c->len;
+    memcpy(c->buf + c->len, s, n);
+    c->len += n;
+}
+
+/*
+  Fills in c with size bytes of log lines: a timestamp, a level (mostly INFO), a service and a message,
+  with a user and a latency field. About 2% are ERROR lines and some of the messages mention a timeout.
+ */
+static void gen_log(struct corpus *c, size_t size)
+{
+    static const char *levels[] = { "INFO", "INFO", "INFO", "INFO", "DEBUG", "WARN" };
+    static const char *services[] = { "api", "auth", "billing", "search", "gateway" };
+    static const char *messages[] = { "request served", "cache miss", "retrying upstream", "connection timeout",
+                                      "slow query", "session refreshed", "payload rejected" };
+    char line[256];
+    c->name = "log";
+    c->buf = malloc(size);
+    c->len = 0;
+    if (c->buf == NULL) error(1, 0, "Allocation failure");
+
+    while (c->len < size) {
+        uint64_t r = rng();
+        const char *level = (r % 50 == 0) ? "ERROR" : levels[(r >> 8) % 6];
+        int n = snprintf(line, sizeof(line), "2026-10-17T%02d:%02d:%02d.%03dZ %s %s[%d]: %s user=%d latency=%dms\n",
+                         (int)(r >> 16) % 24, (int)(r >> 24) % 60, (int)(r >> 32) % 60, (int)(r >> 40) % 1000, level,
+                         services[(r >> 48) % 5], (int)(r >> 52) % 32768, messages[rng() % 7], (int)(rng() % 100000),
+                         (int)(rng() % 1000));
+        corpus_append(c, size, line, n);
+    }
+}
+
+/*
+  Fills in c with size bytes of JSON-ish records of about 256 KiB per line, the kind of line the old fixed size
+  line buffer used to split.
+ */
+static void gen_long(struct corpus *c, size_t size)
+{
+    char field[128];
+    c->name = "long";
+    c->buf = malloc(size);
+    c->len = 0;
+    if (c->buf == NULL) error(1, 0, "Allocation failure");
+
+    while (c->len < size) {
+        corpus_append(c, size, "{", 1);
+        for (size_t linelen = 0; linelen < (256 << 10) && c->len < size;) {
+            char tag[8];
+            for (int i = 0; i < 7; i++) tag[i] = 'a' + rng() % 26;
+            tag[7] = '\0';
+            int n = snprintf(field, sizeof(field), "\"id\":%d,\"tag\":\"%s\",", (int)(rng() % 1000000), tag);
+            corpus_append(c, size, field, n);
+            linelen += n;
+        }
+        corpus_append(c, size, "}\n", 2);
+    }
+}
+
+/*
+  Fills in c with size bytes of lines of a's of random length (up to 8 KiB), with a few lines ending in a b or =.
+  Lines like these are where the backtracking matcher went exponential.
+ */
+static void gen_adversarial(struct corpus *c, size_t size)
+{
+    c->name = "adversarial";
+    c->buf = malloc(size);
+    c->len = 0;
+    if (c->buf == NULL) error(1, 0, "Allocation failure");
+
+    while (c->len < size) {
+        size_t n = 1 + rng() % 8192;
+        if (n > size - c->len) n = size - c->len;
+        memset(c->buf + c->len, 'a', n);
+        c->len += n;
+        uint64_t r = rng() % 16;
+        if (r == 0) corpus_append(c, size, "b", 1);
+        else if (r == 1) corpus_append(c, size, "=", 1);
+        corpus_append(c, size, "\n", 1);
+    }
+}
+
+/*
+  The original search of mygrep, except that an empty line is no longer taken to mean the pattern is anchored.
+  The original matcher was recursive greedy backtracking on * and .: match(i, p) tried, for a starred char that
+  matches input[i], match(i+1, p) first and match(i, p+2) after, and returned the end of the first match it found.
+  That result only depends on (i, p), so here it is computed once per pair, from the end of the line backwards,
+  which gives the same starts and ends in O(len * pattern length) time with no recursion, on lines of any length.
+  Returns the start of the match in the line of len bytes at input and sets *endp to its end, or returns NULL.
+ */
+static const char *oracle_search(const char *input, size_t len, const char *pattern, const char **endp)
+{
+    bool anchored = (pattern[0] == '^');
+    if (anchored) pattern++;
+    size_t plen = strlen(pattern);
+    // row[p] is the end of the match of pattern + p at input + i, or -1, for the current i; next is the row of i+1
+    long *row = malloc((plen + 1) * sizeof(long)), *next = malloc((plen + 1) * sizeof(long));
+    long *ends = malloc((len + 1) * sizeof(long)); // of pattern at each start
+    if (row == NULL || next == NULL || ends == NULL) error(1, 0, "Allocation failure");
+
+    for (size_t i = len + 1; i-- > 0;) {
+        for (size_t p = plen + 1; p-- > 0;) {
+            if (p == plen) {
+                row[p] = i;
+                continue;
+            }
+            char c = pattern[p];
+            bool here = i < len && (input[i] == c || c == '.');
+            if (pattern[p + 1] == '*') row[p] = (here && next[p] >= 0) ? next[p] : row[p + 2];
+            else row[p] = here ? next[p + 1] : -1;
+        }
+        ends[i] = row[0];
+        long *t = row;
+        row = next;
+        next = t;
+    }
+
+    const char *found = NULL;
+    *endp = NULL;
+    for (size_t i = 0; i <= (anchored ? 0 : len); i++) {
+        if (ends[i] >= 0) {
+            found = input + i;
+            *endp = input + ends[i];
+            break;
+        }
+    }
+    free(row);
+    free(next);
+    free(ends);
+    return found;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+  Checks every line of c against search.
+  Returns the number of lines where the two disagree, printing the first few.
+ */
+static size_t check_oracle(const struct corpus *c, struct regex *re, const char *pattern)
+{
+    size_t nbad = 0;
+    for (const char *cur = c->buf, *end = c->buf + c->len; cur < end;) {
+        const char *nl = memchr(cur, '\n', end - cur);
+        if (nl == NULL) nl = end;
+        size_t len = nl - cur;
+        const char *oend, *oracle = oracle_search(cur, len, pattern, &oend);
+        const char *mend;
+        int id;
+        const char *mine = search(re, cur, len, &mend, &id);
+        bool same = (oracle == NULL) ? mine == NULL : mine == oracle && mend == oend;
+        if (!same && nbad++ < 3) {
+            fprintf(stderr, "MISMATCH %s /%s/ on \"%.60s\": oracle [%ld,%ld) mygrep [%ld,%ld)\n", c->name, pattern, cur,
+                    oracle ? (long)(oracle - cur) : -1L, oracle ? (long)(oend - cur) : -1L,
+                    mine ? (long)(mine - cur) : -1L, mine ? (long)(mend - cur) : -1L);
+        }
+        cur = nl + 1;
+    }
+    return nbad;
+}
+
+/*
+  Times one pattern on one corpus: a full grep_buffer pass with emphasis (so every match is located) for throughput,
+  then a pass timing search on each line on its own for the worst case latency.
+ */
+static size_t run_bench(const struct corpus *c, const char *pattern)
+{
+    char *patterns[] = { (char *)pattern };
+    struct regex re;
+    regex_compile(&re, patterns, 1);
+
+    struct output out;
+    out_init(&out, -1, true, false, MODE_PRINT);
+    double start = now();
+    grep_buffer(&out, c->buf, c->len, true, &re, NULL);
+    double elapsed = now() - start;
+
+    double worst = 0;
+    for (const char *cur = c->buf, *end = c->buf + c->len; cur < end;) {
+        const char *nl = memchr(cur, '\n', end - cur), *mend;
+        int id;
+        if (nl == NULL) nl = end;
+        double t = now();
+        search(&re, cur, nl - cur, &mend, &id);
+        t = now() - t;
+        if (t > worst) worst = t;
+        cur = nl + 1;
+    }
+
+    size_t nbad = check_oracle(c, &re, pattern);
+    printf("%-12s %-22s %10.1f %14.0f %12.1f  %s\n", c->name, pattern, c->len / elapsed / 1e6, out.count / elapsed,
+           worst * 1e6, nbad ? "MISMATCH" : "ok");
+    free(out.buf);
+    regex_free(&re);
+    return nbad;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = (size_t)(argc > 1 ? atoi(argv[1]) : DEFAULT_CORPUS_MB) << 20;
+    if (size == 0) error(1, 0, "Usage: grepbench [MB]");
+    select_find_literal();
+
+    struct corpus corpora[3];
+    gen_log(&corpora[0], size);
+    gen_long(&corpora[1], size);
+    gen_adversarial(&corpora[2], size);
+
+    printf("%-12s %-22s %10s %14s %12s  %s\n", "corpus", "pattern", "MB/s", "matches/s", "worst us", "oracle");
+    size_t nbad = 0;
+    for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+        for (int k = 0; k < 3; k++) {
+            if (strcmp(corpora[k].name, benches[b].corpus) == 0) nbad += run_bench(&corpora[k], benches[b].pattern);
+        }
+    }
+
+    for (int k = 0; k < 3; k++) free(corpora[k].buf);
+    return nbad ? 1 : 0;
+}
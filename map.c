@@ -1,38 +1,347 @@
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <math.h>
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+#include "cmap.h"
+#include "allocator.h"
 
 #define DEFAULT_CAPACITY 1023
+#define GROUP 16 // slots whose control bytes are matched at once, the width of an SSE2 register
+#define MAX_LOAD_NUM 7 // the table is resized once more than 7/8 of its slots are used
+#define MAX_LOAD_DEN 8
+#define MIN_LOAD_DEN 8 // and shrunk once less than 1/8 of them hold a key
+#define MIGRATE_SLOTS (2*GROUP) // old slots moved to the new table by each put or remove during a resize
+
+#define CTRL_EMPTY   0x80 // control byte of a slot that was never used
+#define CTRL_DELETED 0xFE // of a slot whose cell was removed, which lookups have to probe past
+#define H2(h)        ((unsigned char)((h) >> (sizeof(unsigned long)*8-7))) // the 7 bits of the hash kept in a full slot's control byte
+
+/*
+  A slot of the table: the full hash of the key, so a probe can reject a slot without touching the key, and the cell.
+  A cell holds the value (elemsz bytes), so values are as aligned as the allocator's blocks, then a struct cellhdr
+  at the next size_t boundary and the key itself, with a NUL after it so cmap_first and cmap_next can hand it out.
+  Lookups compare the hash, then the length, and only then the bytes of the key, and nothing calls strlen on a stored key.
+ */
+struct slot {
+  unsigned long hash ;
+  char *cell ;
+};
+
+/*
+  The part of a cell just before the key. The cells are linked in the order their keys were first put, so iterating
+  goes from a key straight to the next one without touching the table.
+ */
+struct cellhdr {
+  char *next , *prev ; // cells, NULL at the ends
+  size_t len ; // of the key
+};
 
-typedef void (*CleanupValueFn)( void* addr);
+/*
+  An open addressing hash table in the style of a Swiss table. ctrl has one control byte per slot, CTRL_EMPTY,
+  CTRL_DELETED or the top 7 bits of the hash of the slot's key. The slots are probed a group of GROUP at a time,
+  starting at the group the low bits of the hash pick and moving 1, 2, 3... groups further until one with an empty slot.
+  The number of groups is a power of two, so the group is a mask of the hash and these triangular steps visit every group.
+  nused counts full and deleted slots, the ones that make probes longer.
+ */
+struct table {
+  unsigned char *ctrl ;
+  struct slot *slots ;
+  size_t nslots , nused ;
+};
 
+/*
+  A map is one table, or two while it is being resized: the cells are then moved from old to cur MIGRATE_SLOTS
+  old slots at a time by the puts and removes that follow, so no call pays for the whole table. The old slots
+  below migrated have been moved and are marked deleted, lookups try cur first and then old.
+ */
 struct map{
-  char**buckets;
-  size_t nelems , elemsz , nbuckets ;
+  struct table cur , old ; // old.ctrl is NULL when no resize is going on
+  size_t migrated ;
+  unsigned long seed ; // of the hash, different for every map so keys cannot be picked to collide
+  size_t nelems , elemsz , minslots ; // the table never shrinks below the size the capacity hint asked for
+  size_t keyoff ; // offset of the key in a cell, its struct cellhdr is just before it
+  char *head , *tail ; // the cells of the first and last keys put
+  const struct image *image ; // of a frozen map, which has no table and no cells, NULL otherwise
+  size_t mapped ; // bytes of the image if it was mapped from a file, 0 if it was allocated
   CleanupValueFn cleanup ;
+  CAllocator alloc ; // where the map, its tables and its cells come from
 };
 
-typedef struct map CMap ;
 
+static void *frozen_get(const CMap *cm, const char *key, size_t len) ;
+static const char *frozen_first(const CMap *cm) ;
+static const char *frozen_next(const CMap *cm, const char *key) ;
+static void frozen_for_each(const CMap *cm, VisitPairFn fn, void *aux) ;
+
+#define GET_KEY(c)        ((c)+cm->keyoff)
+#define GET_VAL(c)        (c)
+#define HDR(k)            ((struct cellhdr*)(k)-1) // of the cell of a key stored in a cell
+#define KEY_LEN(k)        (HDR(k)->len)
+#define CELL_SIZE(cm,len) ((cm)->keyoff+(len)+1)
+
+static const uint64_t SECRET[4] = { 0xa0761d6478bd642full , 0xe7037ed1a0b428dbull , 0x8ebc6af09c88c6e3ull , 0x589965cc75349c61ull } ;
+
+/*
+  Multiplies *a and *b into 128 bits, leaving the low half in *a and the high half in *b.
+ */
+static inline void multiply(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 r = (unsigned __int128)*a * *b ;
+  *a = (uint64_t)r ;
+  *b = (uint64_t)(r >> 64) ;
+#else
+  uint64_t ha = *a >> 32 , la = (uint32_t)*a , hb = *b >> 32 , lb = (uint32_t)*b ;
+  uint64_t hi = ha*hb , mid1 = ha*lb , mid2 = la*hb , lo = la*lb ;
+  uint64_t t = lo+(mid1 << 32) ;
+  hi += (mid1 >> 32)+(mid2 >> 32)+(t < lo) ;
+  lo = t+(mid2 << 32) ;
+  hi += (lo < t) ;
+  *a = lo ;
+  *b = hi ;
+#endif
+}
+
+/*
+  Multiplies a and b into 128 bits and folds the two halves together.
+ */
+static inline uint64_t mix(uint64_t a, uint64_t b)
+{
+  multiply(&a , &b) ;
+  return a ^ b ;
+}
+
+static inline uint64_t read64(const unsigned char *p){ uint64_t v ; memcpy(&v , p , 8) ; return v ; }
+static inline uint64_t read32(const unsigned char *p){ uint32_t v ; memcpy(&v , p , 4) ; return v ; }
+
+/*
+  Takes as input a key (key) of len bytes and a seed and returns its hash. This is wyhash: the key is read 8 or 16 bytes
+  at a time and each pair of words goes through one 64x64->128 bit multiply, instead of a multiply per byte.
+  Keys of up to 16 bytes, most of them, are read with at most four overlapping loads and no loop.
+ */
+unsigned long cmap_hash(const char *key, size_t len, unsigned long seed)
+{
+  const unsigned char *p = (const unsigned char*)key ;
+  uint64_t a , b , s = seed ^ mix(seed ^ SECRET[0] , SECRET[1]) ;
+  if(len <= 16){
+    if(len >= 4){
+      size_t q = (len >> 3) << 2 ;
+      a = (read32(p) << 32) | read32(p+q) ;
+      b = (read32(p+len-4) << 32) | read32(p+len-4-q) ;
+    }
+    else if(len > 0){
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len-1] ;
+      b = 0 ;
+    }
+    else a = b = 0 ;
+  }
+  else{
+    size_t i = len ;
+    if(i > 48){
+      uint64_t s1 = s , s2 = s ;
+      do{
+        s = mix(read64(p) ^ SECRET[1] , read64(p+8) ^ s) ;
+        s1 = mix(read64(p+16) ^ SECRET[2] , read64(p+24) ^ s1) ;
+        s2 = mix(read64(p+32) ^ SECRET[3] , read64(p+40) ^ s2) ;
+        p += 48 ;
+        i -= 48 ;
+      } while(i > 48) ;
+      s ^= s1 ^ s2 ;
+    }
+    while(i > 16){
+      s = mix(read64(p) ^ SECRET[1] , read64(p+8) ^ s) ;
+      p += 16 ;
+      i -= 16 ;
+    }
+    a = read64(p+i-16) ;
+    b = read64(p+i-8) ;
+  }
+  a ^= SECRET[1] ;
+  b ^= s ;
+  multiply(&a , &b) ;
+  return mix(a ^ SECRET[0] ^ len , b ^ SECRET[1]) ;
+}
+
+/*
+  Returns the hash of the key (key) of len bytes in cm.
+ */
+static inline unsigned long hash(const CMap *cm, const char *key, size_t len)
+{
+  return cmap_hash(key , len , cm->seed) ;
+}
+
+/*
+  Returns a seed for a new map, from a counter mixed with the address of the map and the time.
+ */
+static unsigned long new_seed(const CMap *cm)
+{
+  static atomic_ulong counter ;
+  uint64_t n = atomic_fetch_add(&counter , 1) ;
+  return mix(n ^ (uintptr_t)cm ^ SECRET[2] , (uint64_t)time(NULL) ^ SECRET[3]) ;
+}
 
-#define PTR_TO_NEXT(i)    (char*)((unsigned long*)i)[0]
-#define GET_KEY(i)        i+sizeof(char*)
-#define GET_VAL(i)        i+sizeof(char*)+strlen(GET_KEY(i))+1
+/*
+  Returns a bit mask with bit i set if the control byte i of the group at ctrl is c.
+  The control bytes come from the map's allocator, which need not align them to 16 bytes, so the loads are unaligned.
+ */
+static inline unsigned group_match(const unsigned char *ctrl, unsigned char c)
+{
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)ctrl) , _mm_set1_epi8((char)c))) ;
+#else
+  unsigned mask = 0 ;
+  for(int i = 0 ; i < GROUP ; i++) mask |= (unsigned)(ctrl[i] == c) << i ;
+  return mask ;
+#endif
+}
 
-/* 
- * This function adapted from Eric Roberts' _The Art and Science of C_
+/*
+  Returns a bit mask with bit i set if the slot i of the group at ctrl is empty or deleted, the slots with the top bit set.
  */
-static int hash(const char *s, int nbuckets)
+static inline unsigned group_free(const unsigned char *ctrl)
 {
-   const unsigned long MULTIPLIER = 2630849305L; // magic number
-   unsigned long hashcode = 0;
-   for (int i = 0; s[i] != '\0'; i++)
-      hashcode = hashcode * MULTIPLIER + s[i];
-   return hashcode % nbuckets;
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl)) ;
+#else
+  unsigned mask = 0 ;
+  for(int i = 0 ; i < GROUP ; i++) mask |= (unsigned)(ctrl[i] >> 7) << i ;
+  return mask ;
+#endif
+}
+
+/*
+  Takes as input a CMap (cm), one of its tables (t), a key (key) of len bytes and its hash (h) and returns the slot of t
+  holding key or -1 if it is not there. Only the slots whose control byte matches the top bits of the hash are looked at,
+  and only those whose stored hash is h and whose key is len bytes long have their key compared.
+ */
+static long find_slot(const CMap *cm, const struct table *t, const char *key, size_t len, unsigned long h)
+{
+  size_t mask = t->nslots/GROUP-1 , g = h & mask ;
+  for(size_t probe = 1 ; probe <= mask+1 ; probe++){
+    const unsigned char *ctrl = t->ctrl+g*GROUP ;
+    for(unsigned match = group_match(ctrl , H2(h)) ; match != 0 ; match &= match-1){
+      size_t s = g*GROUP+__builtin_ctz(match) ;
+      if(t->slots[s].hash != h) continue ;
+      const char *stored = GET_KEY(t->slots[s].cell) ;
+      if(KEY_LEN(stored) == len && memcmp(stored , key , len) == 0) return (long)s ;
+    }
+    if(group_match(ctrl , CTRL_EMPTY) != 0) return -1 ; // key would have been put in this group
+    g = (g+probe) & mask ;
+  }
+  return -1 ;
+}
+
+/*
+  Takes as input a CMap (cm), a key (key) of len bytes and its hash (h) and returns the table holding key, setting *slot
+  to its slot, or NULL if key is not in the map.
+ */
+static struct table *find(const CMap *cm, const char *key, size_t len, unsigned long h, long *slot)
+{
+  struct table *t = (struct table*)&cm->cur ;
+  if((*slot = find_slot(cm , t , key , len , h)) >= 0) return t ;
+  t = (struct table*)&cm->old ;
+  if(t->ctrl != NULL && (*slot = find_slot(cm , t , key , len , h)) >= 0) return t ;
+  return NULL ;
+}
+
+/*
+  Takes as input a table (t) and a hash (h) and returns the first empty or deleted slot on the probe sequence of h.
+  There always is one, the table is never allowed to fill up.
+ */
+static size_t free_slot(const struct table *t, unsigned long h)
+{
+  size_t mask = t->nslots/GROUP-1 , g = h & mask ;
+  for(size_t probe = 1 ; ; probe++){
+    unsigned free = group_free(t->ctrl+g*GROUP) ;
+    if(free != 0) return g*GROUP+__builtin_ctz(free) ;
+    g = (g+probe) & mask ;
+  }
+}
+
+/*
+  Puts the cell of the slot (from), whose hash is already known, into the table t.
+ */
+static void place(struct table *t, unsigned char ctrl, struct slot from)
+{
+  size_t to = free_slot(t , from.hash) ;
+  if(t->ctrl[to] == CTRL_EMPTY) t->nused++ ; // a deleted slot was already counted
+  t->ctrl[to] = ctrl ;
+  t->slots[to] = from ;
+}
+
+/*
+  Takes as input a number of elements (n) and returns a number of slots, a power of two of at least GROUP,
+  that holds them under the maximum load.
+ */
+static size_t slots_for(size_t n)
+{
+  size_t need = n*MAX_LOAD_DEN/MAX_LOAD_NUM+1 , nslots = GROUP ;
+  while(nslots < need) nslots *= 2 ;
+  return nslots ;
+}
+
+/*
+  Allocates an empty table of nslots slots for cm.
+ */
+static void alloc_table(CMap *cm, struct table *t, size_t nslots)
+{
+  t->ctrl = cm->alloc.alloc(cm->alloc.ctx , nslots) ;
+  t->slots = cm->alloc.alloc(cm->alloc.ctx , nslots*sizeof(struct slot)) ;
+  if(t->ctrl == NULL || t->slots == NULL) assert("Allocation failure") ;
+  memset(t->ctrl , CTRL_EMPTY , nslots) ;
+  t->nslots = nslots ;
+  t->nused = 0 ;
+}
+
+static void free_table(CMap *cm, struct table *t)
+{
+  cm->alloc.free(cm->alloc.ctx , t->ctrl , t->nslots) ;
+  cm->alloc.free(cm->alloc.ctx , t->slots , t->nslots*sizeof(struct slot)) ;
+  t->ctrl = NULL ;
+  t->slots = NULL ;
+}
+
+/*
+  Moves the cells of the next n old slots of cm into its current table, and drops the old table once they all are.
+  The stored hashes are reused, no key is hashed again.
+ */
+static void migrate(CMap *cm, size_t n)
+{
+  struct table *old = &cm->old ;
+  size_t end = (cm->migrated+n < old->nslots) ? cm->migrated+n : old->nslots ;
+  for(size_t s = cm->migrated ; s < end ; s++){
+    if(old->ctrl[s] & 0x80) continue ; // empty or deleted
+    place(&cm->cur , old->ctrl[s] , old->slots[s]) ;
+    old->ctrl[s] = CTRL_DELETED ; // so probes still go past it
+  }
+  cm->migrated = end ;
+  if(end == old->nslots) free_table(cm , old) ;
+}
+
+/*
+  Starts moving the cells of cm into a new table of nslots slots, which also clears the deleted slots.
+  A resize still going on is finished first.
+ */
+static void resize(CMap *cm, size_t nslots)
+{
+  if(cm->old.ctrl != NULL) migrate(cm , cm->old.nslots) ;
+  cm->old = cm->cur ;
+  cm->migrated = 0 ;
+  alloc_table(cm , &cm->cur , nslots) ;
+  migrate(cm , MIGRATE_SLOTS) ;
 }
 
 /*
@@ -42,17 +351,29 @@ static int hash(const char *s, int nbuckets)
   Returns a CMap with the given parameters.
  */
 CMap *cmap_create(size_t valuesz, size_t capacity_hint, CleanupValueFn fn)
+{
+  return cmap_create_with(valuesz , capacity_hint , fn , &callocator_heap) ;
+}
+
+/*
+  Same as cmap_create, except that the map, its table and every cell come from the allocator (alloc), which is copied.
+  With an arena the whole map can be dropped at once by resetting the arena instead of calling cmap_dispose,
+  a pool sized for the cells (CMAP_CELL_SIZE) saves a malloc and a free per put and remove.
+ */
+CMap *cmap_create_with(size_t valuesz, size_t capacity_hint, CleanupValueFn fn, const CAllocator *alloc)
 {
   if(valuesz == 0) assert("0 value size") ;
-  CMap * map = calloc(sizeof(CMap),1) ;
+  CMap * map = alloc->alloc(alloc->ctx , sizeof(CMap)) ;
   if(map == NULL) assert("Allocation failure") ;
+  memset(map , 0 , sizeof(CMap)) ;
   map->elemsz=  valuesz ;
+  map->keyoff = CMAP_CELL_SIZE(valuesz , 0)-1 ;
+  map->alloc = *alloc ;
+  map->seed = new_seed(map) ;
 
   if(capacity_hint ==0) capacity_hint = DEFAULT_CAPACITY ;
-  map->nbuckets = capacity_hint ;
-
-  map->buckets = calloc(sizeof(char*) , map->nbuckets) ;
-  if(map->buckets==NULL) assert("Allocation failure") ;
+  map->minslots = slots_for(capacity_hint) ;
+  alloc_table(map , &map->cur , map->minslots) ;
   map->nelems = 0 ;
 
   map->cleanup = fn;
@@ -61,28 +382,26 @@ CMap *cmap_create(size_t valuesz, size_t capacity_hint, CleanupValueFn fn)
 }
 
 /*
-  Takes as input a CMap (cm) and handles the deallocation of all dynamically allocated memory calling 
+  Takes as input a CMap (cm) and handles the deallocation of all dynamically allocated memory calling
   he user defined cleanup function if necessary.
  */
 void cmap_dispose(CMap *cm)
 {
-  for(int x = 0 ; x< cm->nbuckets ; x++){
-
-    char * cur = cm->buckets[x] ;
-    while(1){
-      if(cur == NULL) break ;
-
-      char * next = PTR_TO_NEXT(cur) ;
-      char * todealloc = GET_VAL(cur) ;
-      if(cm->cleanup !=NULL) cm->cleanup(todealloc) ;
-      free(cur) ;
-
-      cur= next ;
-    }
+  if(cm->image != NULL){
+    if(cm->mapped != 0) munmap((void*)cm->image , cm->mapped) ;
+    else free((void*)cm->image) ;
+    free(cm) ;
+    return ;
   }
-
-  free(cm->buckets) ;
-  free(cm) ;
+  for(char *cell = cm->head , *next ; cell != NULL ; cell = next){
+    next = HDR(GET_KEY(cell))->next ;
+    if(cm->cleanup !=NULL) cm->cleanup(GET_VAL(cell)) ;
+    cm->alloc.free(cm->alloc.ctx , cell , CELL_SIZE(cm , KEY_LEN(GET_KEY(cell)))) ;
+  }
+  free_table(cm , &cm->cur) ;
+  if(cm->old.ctrl != NULL) free_table(cm , &cm->old) ;
+  CAllocator alloc = cm->alloc ;
+  alloc.free(alloc.ctx , cm , sizeof(CMap)) ;
 }
 
 /*
@@ -94,115 +413,522 @@ int cmap_count(const CMap *cm){
 
 /*
   Takes as  input a CMap (cm), a string (key) and the address of some value to associate with the key.
-  NOTE that we always put the new value at the begining of the bucket as in some applications the most recently input
-  values may be the most used values.
+  Replaces the value if the key is already in the map, which keeps its place in the iteration order. Once more than 7/8 of the table is used a resize starts,
+  into a table twice as big or, if most of the used slots are deleted ones, into one of the same size.
  */
 void cmap_put(CMap *cm, const char *key, const void *addr){
-  int hashval= hash(key , cm->nbuckets) ;
-  char *curfirst = cm->buckets[hashval] ;
-
-  while(curfirst!=NULL){ // loop through the bucket to find if we ust need to replace the value.
-    if(strcmp(GET_KEY(curfirst),key)==0){
+  cmap_put_n(cm , key , strlen(key) , addr) ;
+}
 
-      if(cm->cleanup !=NULL) cm->cleanup(GET_VAL(curfirst)) ; // cleanup the old value if cleanup is non null
+/*
+  Same as cmap_put, except that the key is the len bytes at key, which need not be followed by a NUL,
+  so a key can be looked up straight from a slice of a larger buffer.
+ */
+void cmap_put_n(CMap *cm, const char *key, size_t len, const void *addr){
+  if(cm->image != NULL){
+    assert("Put into a frozen map") ;
+    return ;
+  }
+  unsigned long h = hash(cm , key , len) ;
+  long found ;
+  struct table *t = find(cm , key , len , h , &found) ;
+  if(t != NULL){ // just replace the value
+    char *cell = t->slots[found].cell ;
+    if(cm->cleanup !=NULL) cm->cleanup(GET_VAL(cell)) ; // cleanup the old value if cleanup is non null
+    memcpy(GET_VAL(cell) , addr , cm->elemsz) ; // copy in the new value.
+    if(cm->old.ctrl != NULL) migrate(cm , MIGRATE_SLOTS) ;
+    return ;
+  }
 
-      memcpy(GET_VAL(curfirst) , addr , cm->elemsz) ; // copy in the new value.
-      return ;
-    }
-    curfirst=PTR_TO_NEXT(curfirst) ;
+  if(cm->old.ctrl != NULL) migrate(cm , MIGRATE_SLOTS) ;
+  if((cm->cur.nused+1)*MAX_LOAD_DEN > cm->cur.nslots*MAX_LOAD_NUM){
+    resize(cm , (cm->nelems+1 > cm->cur.nused/2) ? cm->cur.nslots*2 : cm->cur.nslots) ;
   }
 
-  curfirst =cm->buckets[hashval] ; // pointer to the first element of this bucket.
+  char *cell = cm->alloc.alloc(cm->alloc.ctx , CELL_SIZE(cm , len)) ;
+  if(cell==NULL) assert("Allocation failure") ;
+  memcpy(GET_VAL(cell) , addr , cm->elemsz) ; // copy in the value
+  char *stored = GET_KEY(cell) ;
+  *HDR(stored) = (struct cellhdr){ NULL , cm->tail , len } ;
+  memcpy(stored , key , len) ; // copy in the key
+  stored[len] = '\0' ;
+  if(cm->tail != NULL) HDR(GET_KEY(cm->tail))->next = cell ;
+  else cm->head = cell ;
+  cm->tail = cell ;
+
+  place(&cm->cur , H2(h) , (struct slot){ h , cell }) ;
+  cm->nelems++ ;
+}
 
-  char *newFirst = calloc(sizeof(char) , sizeof(char*)+strlen(key)+cm->elemsz+1) ;
-  if(newFirst==NULL) assert("Allocation failure") ;
+/*
+  Takes as input a CMap (cm) and a string (key) and returns the value associated with the key in the map
+  rturns NULL if the key is not in the map. Lookups never move cells or change the map, so threads may
+  look up keys at the same time as long as none of them puts or removes.
+ */
+void *cmap_get(const CMap *cm, const char *key){
+  return cmap_get_n(cm , key , strlen(key)) ;
+}
 
-  ((unsigned long *)newFirst)[0] = (unsigned long)curfirst ; // relink the linked list
+/*
+  Same as cmap_get, except that the key is the len bytes at key, which need not be followed by a NUL.
+ */
+void *cmap_get_n(const CMap *cm, const char *key, size_t len){
+  if(cm->image != NULL) return frozen_get(cm , key , len) ;
+  long s ;
+  struct table *t = find(cm , key , len , hash(cm , key , len) , &s) ;
+  return (t == NULL) ? NULL : (void*)GET_VAL(t->slots[s].cell) ;
+}
 
-  strcpy(GET_KEY(newFirst),key) ; // copy in the key
-  memcpy(GET_VAL(newFirst) , addr , cm->elemsz) ; // copy in the value
+/*
+  Takes as  input a CMap (cm) and a string (key) and removes the key key from the map along with its associated value
+  and frees all dynamically allocated memory. The slot goes back to empty if its group has an empty slot, since then no
+  probe ever went past the group, and is marked deleted otherwise. Once less than 1/8 of the table holds a key
+  a resize into a smaller table starts.
+ */
+void cmap_remove(CMap *cm, const char *key){
+  cmap_remove_n(cm , key , strlen(key)) ;
+}
 
-  cm->buckets[hashval] = newFirst ;
+/*
+  Same as cmap_remove, except that the key is the len bytes at key, which need not be followed by a NUL.
+ */
+void cmap_remove_n(CMap *cm, const char *key, size_t len){
+  if(cm->image != NULL){
+    assert("Remove from a frozen map") ;
+    return ;
+  }
+  long s ;
+  struct table *t = find(cm , key , len , hash(cm , key , len) , &s) ;
+  if(t == NULL) return ;
+
+  char *cell = t->slots[s].cell ;
+  struct cellhdr *hdr = HDR(GET_KEY(cell)) ;
+  if(hdr->prev != NULL) HDR(GET_KEY(hdr->prev))->next = hdr->next ;
+  else cm->head = hdr->next ;
+  if(hdr->next != NULL) HDR(GET_KEY(hdr->next))->prev = hdr->prev ;
+  else cm->tail = hdr->prev ;
+  if(cm->cleanup !=NULL) cm->cleanup(GET_VAL(cell)) ; // call custom cleanup function if it exists.
+  cm->alloc.free(cm->alloc.ctx , cell , CELL_SIZE(cm , KEY_LEN(GET_KEY(cell)))) ;
+
+  if(t == &cm->cur && group_match(t->ctrl+s/GROUP*GROUP , CTRL_EMPTY) != 0){
+    t->ctrl[s] = CTRL_EMPTY ;
+    t->nused-- ;
+  }
+  else t->ctrl[s] = CTRL_DELETED ;
+  cm->nelems -- ;
 
-  cm->nelems++ ;
+  if(cm->old.ctrl != NULL) migrate(cm , MIGRATE_SLOTS) ;
+  else if(cm->cur.nslots > cm->minslots && cm->nelems*MIN_LOAD_DEN < cm->cur.nslots){
+    size_t nslots = slots_for(2*cm->nelems) ;
+    resize(cm , (nslots < cm->minslots) ? cm->minslots : nslots) ;
+  }
 }
 
 /*
-  Takes as input a CMap (cm) and a string (key) and returns the value associated with the key in the map
-  rturns NULL if the key is not in the map.
+  Takes as input a CMap (cm) and returns the first key in the map, the one put first.
  */
-void *cmap_get(const CMap *cm, const char *key){
-  int hashval= hash(key , cm->nbuckets) ;
-  char * cur = cm->buckets[hashval] ;
+const char *cmap_first(const CMap *cm)
+{
+  if(cm->image != NULL) return frozen_first(cm) ;
+  return (cm->head == NULL) ? NULL : GET_KEY(cm->head) ;
+}
 
-  while(cur !=NULL){
-    if(strcmp(GET_KEY(cur) , key)==0) return (void*)(GET_VAL(cur)) ;
+/*
+  Takes as input a CMap (cm) and a string (prevkey) and returns the next key in the map or a NULL if prevkey is the last key in the map.
+  Keys come in the order they were first put. prevkey must be a key returned by cmap_first or cmap_next and still in the map,
+  the next key is found from its cell.
+ */
+const char *cmap_next(const CMap *cm, const char *prevkey)
+{
+  if(cm->image != NULL) return frozen_next(cm , prevkey) ;
+  char *next = HDR(prevkey)->next ;
+  return (next == NULL) ? NULL : GET_KEY(next) ;
+}
 
-    cur = PTR_TO_NEXT(cur) ;
+/*
+  Takes as input a CMap (cm), a function (fn) and an auxiliary pointer (aux) and calls fn on every key, its value and aux,
+  in the order the keys were first put. fn must not put or remove keys.
+ */
+void cmap_for_each(const CMap *cm, VisitPairFn fn, void *aux)
+{
+  if(cm->image != NULL){
+    frozen_for_each(cm , fn , aux) ;
+    return ;
   }
-  return NULL ;
+  for(char *cell = cm->head ; cell != NULL ; cell = HDR(GET_KEY(cell))->next) fn(GET_KEY(cell) , GET_VAL(cell) , aux) ;
 }
 
 /*
-  Takes as  input a CMap (cm) and a string (key) and removes the key key from the map along with its associated value
-  relinks the linked list and frees all dynamically allocated memory.
+  A frozen map is an image that holds everything in one block, with offsets instead of pointers, so it can be written
+  to a file and mapped back by any process. The keys are placed by a minimal perfect hash (hash and displace):
+  the hash picks one of nbuckets buckets, whose displacement, found when the image was built, sends every key of the
+  bucket to its own one of tablesz slots. There are about 2% more slots than keys, so the last buckets to be placed still
+  find free slots quickly, and the keys that land at or past slot nkeys are remapped to the entries below it that no key
+  took, which keeps the nkeys entries dense. A lookup costs one hash, two or three reads and one key compare, and a key
+  that is not in the map is caught by the compare. The values are in an array in entry order, the keys in records in the
+  order they were first put, which is also the order of iteration.
+
+    header | displacement of each bucket (uint32) | remap of the slots past nkeys (uint64) | entries | values | key records
  */
-void cmap_remove(CMap *cm, const char *key){
-  int hashval= hash(key , cm->nbuckets) ;
-
-  char * cur = cm->buckets[hashval] ; // we only want to search the bucket that the string would be in. 
-  char *previous = NULL ; // to relink the list.
-
-  while(cur !=NULL){
-    if(strcmp(GET_KEY(cur) , key) == 0){
-      char * next = PTR_TO_NEXT(cur) ;
-      if(previous !=NULL) ((unsigned long *)previous)[0] = (unsigned long)next ;
-      
-      if(cm->cleanup !=NULL) cm->cleanup(GET_VAL(cur)) ; // call custom cleanup function if it exists.
-
-      // handle the freeing taking into account the edge case that the element being removed is the first one. 
-      if(cur != cm->buckets[hashval]) free(cur) ;
-      else{
-	free(cur) ;
-	cm->buckets[hashval] = NULL ;
-      } 
-      cm->nelems -- ;
-      return ;
+#define IMAGE_MAGIC   "CMAPMPH2"
+#define BUCKET_KEYS   2 // average keys per bucket, more make the image smaller and slower to build
+#define TABLE_SLACK   50 // keys per spare slot of the table the keys are placed in
+#define MAX_ATTEMPTS  8 // seeds tried before giving up on building an image
+#define ALIGN8(n)     (((n)+7) & ~(size_t)7)
+#define ALIGN16(n)    (((n)+15) & ~(size_t)15)
+
+struct image {
+  char magic[8] ;
+  uint64_t size , nkeys , tablesz , elemsz , seed , nbuckets ;
+  uint64_t remap , entries , values , keys ; // offsets of the sections
+};
+
+struct entry {
+  uint64_t hash , key ; // the full hash and the offset of the key
+};
+
+struct keyrec { // followed by the key and a NUL, padded to 8 bytes
+  uint64_t entry , len ;
+};
+
+#define IMG(cm,off)   ((const char*)(cm)->image+(off))
+#define KEYREC(k)     ((const struct keyrec*)(k)-1)
+#define KEYREC_SIZE(len) ALIGN8(sizeof(struct keyrec)+(len)+1)
+
+/*
+  Returns true if count items of width bytes from the offset off end at or before limit, without overflowing.
+ */
+static inline bool section_fits(uint64_t off, uint64_t count, uint64_t width, uint64_t limit)
+{
+  return off <= limit && (width == 0 || count <= (limit-off)/width) ;
+}
+
+/*
+  Returns x scaled from 64 bits to [0, n), a multiply instead of a %.
+ */
+static inline uint64_t scale(uint64_t x, uint64_t n)
+{
+  multiply(&x , &n) ;
+  return n ;
+}
+
+static inline uint64_t image_bucket(uint64_t h, uint64_t nbuckets)
+{
+  return scale(h , nbuckets) ;
+}
+
+static inline uint64_t image_slot(uint64_t h, uint32_t displace, uint64_t tablesz)
+{
+  return scale(mix(h ^ SECRET[2] , (displace+1)*SECRET[3]) , tablesz) ;
+}
+
+/*
+  Returns the entry of the slot of the table the keys were placed in, which is the slot itself below nkeys.
+ */
+static inline uint64_t image_entry(const uint64_t *remap, uint64_t slot, uint64_t nkeys)
+{
+  return (slot < nkeys) ? slot : remap[slot-nkeys] ;
+}
+
+/*
+  Finds a displacement for every bucket that places its keys in free slots of a table of tablesz slots, a few more
+  than nkeys, the fullest buckets first while most slots are free, and fills remap with the free entry below nkeys
+  that each key placed at or past nkeys is sent to. Since some slots are always free, every try of the buckets placed
+  last, which hold one key, succeeds with odds of at least (tablesz-nkeys)/tablesz, so the tries a bucket gets are
+  bounded by a multiple of tablesz/(tablesz-nkeys). Returns false if some bucket runs out of tries, which happens when
+  two keys have the same hash, and the image must be tried with another seed.
+ */
+static bool place_buckets(const uint64_t *hashes, size_t nkeys, size_t tablesz, uint32_t *displace, size_t nbuckets,
+                          uint64_t *remap)
+{
+  size_t *start = calloc(nbuckets+2 , sizeof(size_t)) , *members = malloc((nkeys+1)*sizeof(size_t)) ;
+  size_t *order = malloc(nbuckets*sizeof(size_t)) , *bysize = NULL ;
+  unsigned char *taken = calloc(tablesz , 1) ;
+  uint32_t maxdisplace = 256*(tablesz/(tablesz-nkeys)+1) ; // a singleton fails all of them with odds below e^-256
+  uint64_t *pos = NULL ;
+  bool ok = false ;
+  if(start == NULL || members == NULL || order == NULL || taken == NULL) goto done ;
+
+  // the keys of each bucket, start[b] to start[b+1] in members
+  for(size_t k = 0 ; k < nkeys ; k++) start[image_bucket(hashes[k] , nbuckets)+2]++ ;
+  size_t maxsize = 0 ;
+  for(size_t b = 0 ; b < nbuckets ; b++) if(start[b+2] > maxsize) maxsize = start[b+2] ;
+  for(size_t b = 2 ; b < nbuckets+2 ; b++) start[b] += start[b-1] ;
+  for(size_t k = 0 ; k < nkeys ; k++) members[start[image_bucket(hashes[k] , nbuckets)+1]++] = k ;
+
+  // the buckets by decreasing size, a counting sort
+  bysize = calloc(maxsize+2 , sizeof(size_t)) ;
+  pos = malloc((maxsize+1)*sizeof(uint64_t)) ;
+  if(bysize == NULL || pos == NULL) goto done ;
+  for(size_t b = 0 ; b < nbuckets ; b++) bysize[maxsize-(start[b+1]-start[b])+1]++ ;
+  for(size_t s = 1 ; s <= maxsize+1 ; s++) bysize[s] += bysize[s-1] ;
+  for(size_t b = 0 ; b < nbuckets ; b++) order[bysize[maxsize-(start[b+1]-start[b])]++] = b ;
+
+  for(size_t i = 0 ; i < nbuckets ; i++){
+    size_t b = order[i] , n = start[b+1]-start[b] ;
+    if(n == 0) break ; // and so are all the ones after it
+    uint32_t d ;
+    for(d = 0 ; d < maxdisplace ; d++){
+      size_t j ;
+      for(j = 0 ; j < n ; j++){
+        pos[j] = image_slot(hashes[members[start[b]+j]] , d , tablesz) ;
+        if(taken[pos[j]]) break ;
+        taken[pos[j]] = 1 ;
+      }
+      if(j == n) break ;
+      while(j-- > 0) taken[pos[j]] = 0 ; // undo the ones of this attempt
     }
+    if(d == maxdisplace) goto done ;
+    displace[b] = d ;
+  }
 
-    previous= cur ;
-    cur = PTR_TO_NEXT(cur) ; // follow the linked list.
-  } 
+  // the keys past nkeys go to the entries below it that no key took, as many as there are of them
+  size_t free_entry = 0 ;
+  for(size_t slot = nkeys ; slot < tablesz ; slot++){
+    if(!taken[slot]) continue ;
+    while(taken[free_entry]) free_entry++ ;
+    remap[slot-nkeys] = free_entry++ ;
+  }
+  ok = true ;
+done:
+  free(start) ;
+  free(members) ;
+  free(order) ;
+  free(bysize) ;
+  free(taken) ;
+  free(pos) ;
+  return ok ;
 }
 
 /*
-  Takes as input a CMap (cm) and returns the first key in the map.
+  Takes as input a CMap (cm) that is not frozen and returns its image in a block from malloc, or NULL if there is
+  no memory or no minimal perfect hash was found for its keys.
  */
-const char *cmap_first(const CMap *cm)
-{ 
-  if(cm->nelems==0) return NULL ; // edge case to avoid searching all buckets in the case of empty map.
-  for(int x = 0 ; x< cm->nbuckets ; x++){
-    if(cm->buckets[x] != NULL){
-      return GET_KEY(cm->buckets[x]) ;
+static struct image *build_image(const CMap *cm)
+{
+  size_t nkeys = cm->nelems , nbuckets = nkeys/BUCKET_KEYS+1 , keybytes = 0 ;
+  size_t tablesz = nkeys+nkeys/TABLE_SLACK+1 , nremap = tablesz-nkeys ;
+  uint64_t *hashes = malloc((nkeys+1)*sizeof(uint64_t)) , *remap = calloc(nremap , sizeof(uint64_t)) ;
+  uint32_t *displace = calloc(nbuckets , sizeof(uint32_t)) ;
+  struct image *image = NULL ;
+  if(hashes == NULL || remap == NULL || displace == NULL) goto done ;
+
+  unsigned long seed = cm->seed ;
+  for(int attempt = 0 ; ; attempt++){
+    if(attempt == MAX_ATTEMPTS) goto done ;
+    size_t k = 0 ;
+    keybytes = 0 ;
+    for(const char *cell = cm->head ; cell != NULL ; cell = HDR(GET_KEY(cell))->next , k++){
+      hashes[k] = cmap_hash(GET_KEY(cell) , KEY_LEN(GET_KEY(cell)) , seed) ;
+      keybytes += KEYREC_SIZE(KEY_LEN(GET_KEY(cell))) ;
     }
+    memset(displace , 0 , nbuckets*sizeof(uint32_t)) ;
+    if(place_buckets(hashes , nkeys , tablesz , displace , nbuckets , remap)) break ;
+    seed = mix(seed ^ SECRET[0] , attempt+SECRET[1]) ;
   }
 
-  return NULL ;
+  size_t remapoff = ALIGN8(sizeof(struct image)+nbuckets*sizeof(uint32_t)) ;
+  size_t entries = remapoff+nremap*sizeof(uint64_t) ;
+  size_t values = ALIGN16(entries+nkeys*sizeof(struct entry)) ;
+  size_t keys = ALIGN8(values+nkeys*cm->elemsz) ;
+  size_t size = keys+keybytes ;
+  image = calloc(size , 1) ;
+  if(image == NULL) goto done ;
+  *image = (struct image){ .size = size , .nkeys = nkeys , .tablesz = tablesz , .elemsz = cm->elemsz , .seed = seed ,
+                           .nbuckets = nbuckets , .remap = remapoff , .entries = entries , .values = values , .keys = keys } ;
+  memcpy(image->magic , IMAGE_MAGIC , sizeof(image->magic)) ;
+  memcpy((char*)image+sizeof(struct image) , displace , nbuckets*sizeof(uint32_t)) ;
+  memcpy((char*)image+remapoff , remap , nremap*sizeof(uint64_t)) ;
+
+  struct entry *entry = (struct entry*)((char*)image+entries) ;
+  char *rec = (char*)image+keys ;
+  size_t k = 0 ;
+  for(const char *cell = cm->head ; cell != NULL ; cell = HDR(GET_KEY(cell))->next , k++){
+    const char *key = GET_KEY(cell) ;
+    size_t len = KEY_LEN(key) ;
+    uint64_t e = image_entry(remap , image_slot(hashes[k] , displace[image_bucket(hashes[k] , nbuckets)] , tablesz) , nkeys) ;
+    *(struct keyrec*)rec = (struct keyrec){ e , len } ;
+    memcpy(rec+sizeof(struct keyrec) , key , len) ;
+    entry[e] = (struct entry){ hashes[k] , rec+sizeof(struct keyrec)-(char*)image } ;
+    memcpy((char*)image+values+e*cm->elemsz , GET_VAL(cell) , cm->elemsz) ;
+    rec += KEYREC_SIZE(len) ;
+  }
+done:
+  free(hashes) ;
+  free(remap) ;
+  free(displace) ;
+  return image ;
 }
 
 /*
-  Takes as input a CMap (cm) and a string (prevkey) and returns the next key in the map or a NULL if prevkey is the last key in the map.
+  Returns a read-only CMap on image, which is mapped bytes long or was allocated if mapped is 0.
  */
-const char *cmap_next(const CMap *cm, const char *prevkey)
+static CMap *frozen_map(const struct image *image, size_t mapped)
 {
-  int hashval = hash(prevkey , cm->nbuckets) ;
-  char * next =(char*)((unsigned long *)(prevkey-sizeof(char*)))[0] ; // get the pointer to the next cell from prevkey
+  CMap *map = calloc(1 , sizeof(CMap)) ;
+  if(map == NULL) return NULL ;
+  map->image = image ;
+  map->mapped = mapped ;
+  map->nelems = image->nkeys ;
+  map->elemsz = image->elemsz ;
+  map->seed = image->seed ;
+  map->alloc = callocator_heap ;
+  return map ;
+}
 
-  if(next != NULL) return GET_KEY(next) ; // if non-null return it. 
+/*
+  Takes as input a CMap (cm) and returns a frozen copy of it: a read-only map holding its keys and values in one block
+  laid out for lookups by a minimal perfect hash, or NULL if it cannot be built. cmap_put and cmap_remove do nothing
+  on a frozen map, everything else works as on cm. The values are copied as they are, and the cleanup function is
+  never called on them.
+ */
+CMap *cmap_freeze(const CMap *cm)
+{
+  if(cm->image != NULL){ // a copy of the image
+    struct image *image = malloc(cm->image->size) ;
+    if(image == NULL) return NULL ;
+    memcpy(image , cm->image , cm->image->size) ;
+    CMap *map = frozen_map(image , 0) ;
+    if(map == NULL) free(image) ;
+    return map ;
+  }
+  struct image *image = build_image(cm) ;
+  if(image == NULL) return NULL ;
+  CMap *map = frozen_map(image , 0) ;
+  if(map == NULL) free(image) ;
+  return map ;
+}
 
-  for(int x = hashval+1 ; x< cm->nbuckets ; x++){
-    if(cm->buckets[x] != NULL) return GET_KEY(cm->buckets[x]) ; // search the rest of the buckets for the next key.
+/*
+  Takes as input a CMap (cm) and a file name (path) and writes the frozen image of cm to the file, by way of a
+  temporary file renamed over it. Returns false, with errno set, if it could not. The values are written as they are,
+  so they should not hold pointers.
+ */
+bool cmap_save(const CMap *cm, const char *path)
+{
+  struct image *built = NULL ;
+  const struct image *image = cm->image ;
+  if(image == NULL){
+    image = built = build_image(cm) ;
+    if(image == NULL){
+      if(errno == 0) errno = EINVAL ;
+      return false ;
+    }
   }
 
-  return NULL ;
+  size_t tmplen = strlen(path)+32 ;
+  char *tmp = malloc(tmplen) ;
+  bool ok = false ;
+  if(tmp != NULL){
+    snprintf(tmp , tmplen , "%s.%d" , path , (int)getpid()) ;
+    FILE *fp = fopen(tmp , "w") ;
+    if(fp != NULL){
+      ok = fwrite(image , 1 , image->size , fp) == image->size ;
+      ok = (fclose(fp) == 0) && ok ;
+      ok = ok && rename(tmp , path) == 0 ;
+      if(!ok){
+        int saved = errno ;
+        unlink(tmp) ;
+        errno = saved ;
+      }
+    }
+    free(tmp) ;
+  }
+  free(built) ;
+  return ok ;
+}
+
+/*
+  Takes as input the name of a file written by cmap_save (path) and returns a frozen CMap on the file mapped read-only,
+  so its pages are shared by every process that opens it and nothing is copied or hashed at load time.
+  The values cmap_get returns are in read-only memory and must not be changed.
+  Only the header is checked here, that its sections are in order and inside the file. The offsets and lengths in the
+  sections are checked as lookups and iteration read them, so a damaged file makes keys missing, not reads outside it.
+  Returns NULL, with errno set, if the file cannot be mapped or has no image header. cmap_dispose unmaps it.
+ */
+CMap *cmap_open_mapped(const char *path)
+{
+  int fd = open(path , O_RDONLY | O_CLOEXEC) ;
+  if(fd < 0) return NULL ;
+  struct stat st ;
+  if(fstat(fd , &st) != 0){
+    close(fd) ;
+    return NULL ;
+  }
+  size_t size = st.st_size ;
+  void *mem = (size >= sizeof(struct image)) ? mmap(NULL , size , PROT_READ , MAP_SHARED , fd , 0) : MAP_FAILED ;
+  close(fd) ;
+  if(mem == MAP_FAILED){
+    if(size < sizeof(struct image)) errno = EINVAL ;
+    return NULL ;
+  }
+
+  const struct image *image = mem ;
+  bool valid = memcmp(image->magic , IMAGE_MAGIC , sizeof(image->magic)) == 0 && image->size == size && image->elemsz > 0
+    && image->nbuckets > 0 && image->tablesz > image->nkeys
+    && section_fits(sizeof(struct image) , image->nbuckets , sizeof(uint32_t) , image->remap) && image->remap % 8 == 0
+    && section_fits(image->remap , image->tablesz-image->nkeys , sizeof(uint64_t) , image->entries) && image->entries % 8 == 0
+    && section_fits(image->entries , image->nkeys , sizeof(struct entry) , image->values) && image->values % 16 == 0
+    && section_fits(image->values , image->nkeys , image->elemsz , image->keys) && image->keys % 8 == 0
+    && image->keys <= size ;
+  CMap *map = valid ? frozen_map(image , size) : NULL ;
+  if(map == NULL){
+    munmap(mem , size) ;
+    if(!valid) errno = EINVAL ;
+  }
+  return map ;
+}
+
+/*
+  Returns the key of the key record at the offset off of the image of cm, or NULL if the record is not all inside the
+  key records or its key has no NUL after it, which only happens in a damaged image.
+ */
+static const char *frozen_key(const CMap *cm, uint64_t off)
+{
+  const struct image *image = cm->image ;
+  if(off < image->keys || off % 8 != 0 || !section_fits(off , 1 , sizeof(struct keyrec) , image->size)) return NULL ;
+  const char *key = IMG(cm , off)+sizeof(struct keyrec) ;
+  uint64_t room = image->size-off-sizeof(struct keyrec) ; // for the key and its NUL
+  return (KEYREC(key)->len < room && key[KEYREC(key)->len] == '\0') ? key : NULL ;
+}
+
+/*
+  Returns the value of the key (key) of len bytes in the frozen map cm, or NULL if it is not there.
+ */
+static void *frozen_get(const CMap *cm, const char *key, size_t len)
+{
+  const struct image *image = cm->image ;
+  if(image->nkeys == 0) return NULL ;
+  uint64_t h = cmap_hash(key , len , image->seed) ;
+  const uint32_t *displace = (const uint32_t*)(image+1) ;
+  const uint64_t *remap = (const uint64_t*)IMG(cm , image->remap) ;
+  uint64_t e = image_entry(remap , image_slot(h , displace[image_bucket(h , image->nbuckets)] , image->tablesz) , image->nkeys) ;
+  if(e >= image->nkeys) return NULL ; // a damaged remap
+  const struct entry *entry = (const struct entry*)IMG(cm , image->entries)+e ;
+  if(entry->hash != h || entry->key < sizeof(struct keyrec)) return NULL ;
+  const char *stored = frozen_key(cm , entry->key-sizeof(struct keyrec)) ;
+  if(stored == NULL || KEYREC(stored)->len != len || memcmp(stored , key , len) != 0) return NULL ;
+  return (void*)IMG(cm , image->values+e*image->elemsz) ;
+}
+
+static const char *frozen_first(const CMap *cm)
+{
+  return (cm->image->nkeys == 0) ? NULL : frozen_key(cm , cm->image->keys) ;
+}
+
+/*
+  The key after the key (key) of a frozen map, or NULL if it is the last one.
+ */
+static const char *frozen_next(const CMap *cm, const char *key)
+{
+  uint64_t next = key-sizeof(struct keyrec)-IMG(cm , 0)+KEYREC_SIZE(KEYREC(key)->len) ;
+  return (next < cm->image->size) ? frozen_key(cm , next) : NULL ;
+}
+
+static void frozen_for_each(const CMap *cm, VisitPairFn fn, void *aux)
+{
+  for(const char *key = frozen_first(cm) ; key != NULL ; key = frozen_next(cm , key)){
+    if(KEYREC(key)->entry >= cm->image->nkeys) break ; // a damaged image
+    fn(key , (void*)IMG(cm , cm->image->values+KEYREC(key)->entry*cm->elemsz) , aux) ;
+  }
 }
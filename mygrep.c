@@ -1,134 +1,1504 @@
-
+#define _GNU_SOURCE // memmem, memrchr
 #include <error.h>
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-#define MAX_LINE_LEN 1024
+#define READ_CHUNK (1<<20) // read size for inputs that cannot be mapped (stdin, pipes)
+#define PARALLEL_CHUNK (16<<20) // size of the byte ranges a large file is split into with -j
+#define JOBS_AHEAD 4 // per thread, how far workers may run ahead of the output already written
+#define OUTBUF_SIZE (1<<18) // output is written to stdout in blocks of this size
+#define DENTS_SIZE (1<<15) // getdents64 buffer of the -r directory walk
+#define SNIFF_SIZE 4096 // files whose first SNIFF_SIZE bytes hold a NUL are skipped by -r as binary
 
 #define OPEN_EMPHASIS "\e[7m"
 #define CLOSE_EMPHASIS "\e[0m"
 
+#define DFA_MAX_STATES 2048 // cached DFA states before the cache is flushed and rebuilt from scratch
+
+#define DFA_ACCEPT     0x1
+#define DFA_DEAD       0x2
+#define DFA_ACCEPT_BOL 0x4 // reverse DFAs only: a ^ pattern matched, which counts only at the begining of the line
+
+
+/*
+  One element of a compiled pattern: a literal char, or the metachar . (any), optionally followed by *.
+  The atoms of a pattern are followed by a match atom (match is the index of the pattern, -1 for every other atom),
+  whose bol is set if the pattern began with the metachar ^.
+ */
+struct atom {
+  unsigned char c ;
+  bool any , star , bol ;
+  int match ;
+};
+
+/*
+  Thompson NFA of a set of patterns: the atoms of every pattern one after the other, each run ending in its match atom.
+  NFA state i means "about to match atom i" and reaching a match atom means that pattern matched.
+  The only epsilon moves are the ones that skip over a starred atom.
+  starts holds the first atom of each pattern and bol which of the patterns began with the metachar ^.
+  reversed is set for the NFA of the reversed patterns, whose ^ patterns must instead end at the begining of the line.
+ */
+struct nfa {
+  struct atom *atoms ;
+  int natoms , npatterns ;
+  int *starts ;
+  bool *bol ;
+  bool reversed ;
+};
+
+/*
+  Lazily built DFA over sets of NFA states. Each DFA state is a bitset of NFA states (natoms bits)
+  with a row of 256 transitions that are filled in the first time they are taken (-1 until then).
+  When unanchored is set the pattern starts are added back after every step, so that a match may begin at any offset.
+  start is the state for matching from the begining of a line and start_mid from anywhere else (no ^ patterns).
+  pattern holds, per state, the lowest pattern whose match atom is in the set (-1 for none).
+  The cache is bounded by DFA_MAX_STATES and is flushed when it fills up, which keeps memory fixed for huge patterns.
+ */
+struct dfa {
+  const struct nfa *nfa ;
+  bool unanchored ;
+  int nwords ; // uint64_t words per bitset
+  int nstates , start , start_mid ;
+  uint64_t *sets ; // nstates*nwords
+  int *trans ; // nstates*256
+  unsigned char *flags ;
+  int *pattern ;
+  int *table ; // open addressing hash of sets -> state index
+  size_t tablesz ;
+  uint64_t *scratch ;
+};
+
+/*
+  Aho-Corasick automaton over the patterns of -f that are plain strings (no metachars), which would otherwise
+  blow up the DFA cache when there are thousands of them. Bytes are mapped to classes (0 for bytes that appear in no
+  pattern) and go is the complete transition table, nnodes rows of nclasses, filled in along the failure links.
+  match is the lowest pattern ending at a node (-1 for none), dict the nearest node down its failure chain that has a match.
+ */
+struct ac {
+  int nnodes , nclasses , maxdepth ;
+  unsigned char classes[256] ;
+  int *go , *match , *dict , *depth ;
+};
+
+/*
+  The patterns compiled once in main. fwd is the NFA of the patterns as written, rev the same atoms reversed.
+  Three DFAs answer the leftmost-longest query in linear time:
+    find  - forward unanchored, tells whether the line matches at all (stops at the first accepting state),
+    first - reverse unanchored, scanned from the end of the line to find the leftmost offset a match can start at,
+    extend - forward anchored, run from that offset to find the longest match.
+  NOTE the metachar ^ is handled by bol in the NFA. anchored is set when every pattern has one,
+  in which case only extend is used from offset 0.
+
+  With -f, the plain string patterns go to ac instead (NULL if there are none) and nregex counts the others.
+  literal is the longest run of plain chars every match must contain (litlen is 0 if there is none),
+  which grep_buffer looks for before running any of the DFAs. Only a single pattern has one.
+ */
+struct regex {
+  struct nfa fwd , rev ;
+  int nregex ;
+  bool anchored ;
+  struct dfa find , first , extend ;
+  struct ac *ac ;
+  char *literal ;
+  size_t litlen ;
+};
+
+
+/*
+  Adds NFA state i and its epsilon closure to the bitset set. A starred atom may be skipped,
+  so the closure of i runs forward over starred atoms up to the first non-starred one (or the match atom).
+ */
+static void add_state(const struct nfa *nfa, uint64_t *set, int i)
+{
+  while(1){
+    set[i/64] |= (uint64_t)1<<(i%64) ;
+    if(nfa->atoms[i].match >= 0 || !nfa->atoms[i].star) return ;
+    i++ ;
+  }
+}
+
+/*
+  Adds the atoms of pattern (without its leading ^) to nfa, followed by a match atom for the pattern numbered id.
+  A * that does not follow an atom is treated as a literal char like the original recursive matcher did.
+  nfa->atoms must have room for strlen(pattern)+1 more atoms.
+ */
+static void nfa_add(struct nfa *nfa, const char *pattern, int id, bool bol)
+{
+  nfa->starts[nfa->npatterns] = nfa->natoms ;
+  nfa->bol[nfa->npatterns++] = bol ;
+
+  for(int p = 0 ; pattern[p] != '\0' ; p++){
+    struct atom *a = &nfa->atoms[nfa->natoms++] ;
+    a->c = pattern[p] ;
+    a->any = (pattern[p] == '.') ;
+    a->star = (pattern[p+1] == '*') ;
+    a->match = -1 ;
+    if(a->star) p++ ; // skip the *
+  }
+  nfa->atoms[nfa->natoms++] = (struct atom){ .match = id , .bol = bol } ;
+}
+
+/*
+  Fills in rev with the patterns of fwd, each with its atoms in reverse order. The reverse of a sequence of
+  (possibly starred) atoms is the same atoms backwards, so the reversed patterns need no other rewriting.
+ */
+static void nfa_reverse(struct nfa *rev, const struct nfa *fwd)
+{
+  *rev = *fwd ;
+  rev->reversed = true ;
+  rev->atoms = malloc(sizeof(struct atom)*fwd->natoms) ;
+  if(rev->atoms == NULL) error(1,0,"Allocation failure") ;
+
+  for(int k = 0 ; k < fwd->npatterns ; k++){
+    int first = fwd->starts[k] , last = first ; // last is the match atom of pattern k
+    while(fwd->atoms[last].match < 0) last++ ;
+    for(int i = first ; i < last ; i++) rev->atoms[first+last-1-i] = fwd->atoms[i] ;
+    rev->atoms[last] = fwd->atoms[last] ;
+  }
+}
+
+static size_t hash_set(const uint64_t *set, int nwords)
+{
+  uint64_t h = 14695981039346656037ULL ;
+  for(int i = 0 ; i < nwords ; i++) h = (h^set[i])*1099511628211ULL ;
+  return (size_t)(h^(h>>29)) ;
+}
+
+/*
+  Drops every cached state and re-adds the start states so that matching can go on with a fresh cache.
+ */
+static void dfa_flush(struct dfa *d) ;
+
+/*
+  Returns the index of the DFA state for the bitset set, adding it to the cache if it is not there yet.
+  flushed is an outparameter set to true if the cache had to be flushed to make room (all older indices are then invalid).
+ */
+static int dfa_lookup(struct dfa *d, const uint64_t *set, bool *flushed)
+{
+  size_t mask = d->tablesz-1 ;
+  size_t h = hash_set(set , d->nwords) & mask ;
+  for(; d->table[h] >= 0 ; h = (h+1) & mask){
+    if(memcmp(d->sets+(size_t)d->table[h]*d->nwords , set , d->nwords*sizeof(uint64_t)) == 0) return d->table[h] ;
+  }
+
+  if(d->nstates == DFA_MAX_STATES){ // the cache is full, start over
+    memcpy(d->scratch , set , d->nwords*sizeof(uint64_t)) ; // set may point into the cache being flushed
+    dfa_flush(d) ;
+    *flushed = true ;
+    return dfa_lookup(d , d->scratch , flushed) ;
+  }
+
+  int s = d->nstates++ ;
+  memcpy(d->sets+(size_t)s*d->nwords , set , d->nwords*sizeof(uint64_t)) ;
+  memset(d->trans+(size_t)s*256 , -1 , 256*sizeof(int)) ;
+
+  const struct nfa *nfa = d->nfa ;
+  d->flags[s] = DFA_DEAD ;
+  d->pattern[s] = -1 ;
+  for(int w = 0 ; w < d->nwords ; w++){
+    for(uint64_t bits = set[w] ; bits ; bits &= bits-1){
+      d->flags[s] &= ~DFA_DEAD ;
+      const struct atom *a = &nfa->atoms[w*64+__builtin_ctzll(bits)] ;
+      if(a->match < 0) continue ;
+      if(d->pattern[s] < 0 || a->match < d->pattern[s]) d->pattern[s] = a->match ;
+      d->flags[s] |= (nfa->reversed && a->bol) ? DFA_ACCEPT_BOL : DFA_ACCEPT ; // only a reversed ^ pattern has to be told apart
+    }
+  }
+
+  d->table[h] = s ;
+  return s ;
+}
+
+/*
+  Adds the start of every pattern to set, or with mid set only those that can start in the middle of a line.
+  The reversed patterns can all end anywhere, so for them mid makes no difference.
+ */
+static void add_starts(const struct nfa *nfa, uint64_t *set, bool mid)
+{
+  for(int k = 0 ; k < nfa->npatterns ; k++){
+    if(!mid || !nfa->bol[k] || nfa->reversed) add_state(nfa , set , nfa->starts[k]) ;
+  }
+}
+
+static void dfa_flush(struct dfa *d)
+{
+  memset(d->table , -1 , d->tablesz*sizeof(int)) ;
+  d->nstates = 0 ;
+
+  uint64_t start[d->nwords] ;
+  bool flushed = false ;
+  memset(start , 0 , sizeof(start)) ;
+  add_starts(d->nfa , start , false) ;
+  d->start = dfa_lookup(d , start , &flushed) ;
+
+  memset(start , 0 , sizeof(start)) ;
+  add_starts(d->nfa , start , true) ;
+  d->start_mid = dfa_lookup(d , start , &flushed) ;
+}
+
+/*
+  Takes as input a dfa to initialize, the NFA it simulates and whether a match may start at any offset.
+ */
+static void dfa_init(struct dfa *d, const struct nfa *nfa, bool unanchored)
+{
+  d->nfa = nfa ;
+  d->unanchored = unanchored ;
+  d->nwords = (nfa->natoms+63)/64 ;
+  d->tablesz = 2*DFA_MAX_STATES ;
+  d->sets = malloc(sizeof(uint64_t)*d->nwords*DFA_MAX_STATES) ;
+  d->trans = malloc(sizeof(int)*256*DFA_MAX_STATES) ;
+  d->flags = malloc(DFA_MAX_STATES) ;
+  d->pattern = malloc(sizeof(int)*DFA_MAX_STATES) ;
+  d->table = malloc(sizeof(int)*d->tablesz) ;
+  d->scratch = malloc(sizeof(uint64_t)*d->nwords) ;
+  if(d->sets == NULL || d->trans == NULL || d->flags == NULL || d->pattern == NULL || d->table == NULL || d->scratch == NULL)
+    error(1,0,"Allocation failure") ;
+  dfa_flush(d) ;
+}
+
+static void dfa_free(struct dfa *d)
+{
+  free(d->sets) ;
+  free(d->trans) ;
+  free(d->flags) ;
+  free(d->pattern) ;
+  free(d->table) ;
+  free(d->scratch) ;
+}
+
+/*
+  Computes (and caches) the transition out of state s on the char c and returns the next state.
+  Only called on a cache miss, the hot loops read d->trans directly.
+ */
+static int dfa_step(struct dfa *d, int s, unsigned char c)
+{
+  const struct nfa *nfa = d->nfa ;
+  uint64_t next[d->nwords] , cur[d->nwords] ;
+  memset(next , 0 , sizeof(next)) ;
+  memcpy(cur , d->sets+(size_t)s*d->nwords , sizeof(cur)) ;
+
+  for(int w = 0 ; w < d->nwords ; w++){
+    for(uint64_t bits = cur[w] ; bits ; bits &= bits-1){
+      int i = w*64+__builtin_ctzll(bits) ;
+      const struct atom *a = &nfa->atoms[i] ;
+      if(a->match < 0 && (a->any || a->c == c)) add_state(nfa , next , a->star ? i : i+1) ; // a starred atom stays put to allow for more copies
+    }
+  }
+  if(d->unanchored) add_starts(nfa , next , true) ;
+
+  bool flushed = false ;
+  int t = dfa_lookup(d , next , &flushed) ;
+  if(!flushed) d->trans[(size_t)s*256+c] = t ;
+  return t ;
+}
+
+static inline int dfa_next(struct dfa *d, int s, unsigned char c)
+{
+  int t = d->trans[(size_t)s*256+c] ;
+  return t >= 0 ? t : dfa_step(d , s , c) ;
+}
+
+/*
+  Fills in the required literal of re: the longest run of atoms that are neither starred nor the metachar .
+  Every match of the pattern contains that run, so a line without it cannot match. Only used with a single pattern.
+ */
+static void extract_literal(struct regex *re)
+{
+  const struct nfa *nfa = &re->fwd ;
+  int best = 0 , bestlen = 0 ;
+  for(int i = 0 ; i < nfa->natoms ; ){
+    int j = i ;
+    while(j < nfa->natoms && nfa->atoms[j].match < 0 && !nfa->atoms[j].star && !nfa->atoms[j].any) j++ ;
+    if(j-i > bestlen){
+      best = i ;
+      bestlen = j-i ;
+    }
+    i = j+1 ;
+  }
+
+  re->litlen = bestlen ;
+  re->literal = malloc(bestlen+1) ;
+  if(re->literal == NULL) error(1,0,"Allocation failure") ;
+  for(int i = 0 ; i < bestlen ; i++) re->literal[i] = nfa->atoms[best+i].c ;
+}
+
+/*
+  Vectorized substring search used by the literal prefilter. Returns a pointer to the first occurrence of the k byte
+  needle in the n bytes at hay, or NULL. Compares the first and the last byte of the needle against a whole block
+  of candidate positions at once and only calls memcmp on positions where both agree. Assumes k >= 2.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static const char *find_literal_sse2(const char *hay, size_t n, const char *needle, size_t k)
+{
+  const __m128i first = _mm_set1_epi8(needle[0]) , last = _mm_set1_epi8(needle[k-1]) ;
+  size_t i = 0 ;
+  for(; i+k-1+16 <= n ; i += 16){
+    __m128i a = _mm_loadu_si128((const __m128i*)(hay+i)) ;
+    __m128i b = _mm_loadu_si128((const __m128i*)(hay+i+k-1)) ;
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a , first) , _mm_cmpeq_epi8(b , last))) ;
+    while(mask){
+      size_t at = i+__builtin_ctz(mask) ;
+      if(memcmp(hay+at+1 , needle+1 , k-2) == 0) return hay+at ;
+      mask &= mask-1 ; // clear the lowest candidate
+    }
+  }
+  return memmem(hay+i , n-i , needle , k) ; // the tail shorter than a block
+}
+
+__attribute__((target("avx2")))
+static const char *find_literal_avx2(const char *hay, size_t n, const char *needle, size_t k)
+{
+  const __m256i first = _mm256_set1_epi8(needle[0]) , last = _mm256_set1_epi8(needle[k-1]) ;
+  size_t i = 0 ;
+  for(; i+k-1+32 <= n ; i += 32){
+    __m256i a = _mm256_loadu_si256((const __m256i*)(hay+i)) ;
+    __m256i b = _mm256_loadu_si256((const __m256i*)(hay+i+k-1)) ;
+    unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a , first) , _mm256_cmpeq_epi8(b , last))) ;
+    while(mask){
+      size_t at = i+__builtin_ctz(mask) ;
+      if(memcmp(hay+at+1 , needle+1 , k-2) == 0) return hay+at ;
+      mask &= mask-1 ;
+    }
+  }
+  return memmem(hay+i , n-i , needle , k) ;
+}
+#endif
+
+static const char *find_literal_memmem(const char *hay, size_t n, const char *needle, size_t k)
+{
+  return memmem(hay , n , needle , k) ;
+}
+
+static const char *(*find_literal_impl)(const char *, size_t, const char *, size_t) = find_literal_memmem ;
+
+/*
+  Picks the widest substring search the cpu supports. Called once from main.
+ */
+static void select_find_literal(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init() ;
+  if(__builtin_cpu_supports("avx2")) find_literal_impl = find_literal_avx2 ;
+  else if(__builtin_cpu_supports("sse2")) find_literal_impl = find_literal_sse2 ;
+#endif
+}
+
+/*
+  Returns the first occurrence of the required literal of re in the n bytes at hay, or NULL.
+ */
+static inline const char *find_literal(const struct regex *re, const char *hay, size_t n)
+{
+  if(re->litlen == 1) return memchr(hay , re->literal[0] , n) ;
+  return find_literal_impl(hay , n , re->literal , re->litlen) ;
+}
 
 /*
-  Simple recursive greedy regular expression matching handling the metachars * . and ^.
-  NOTE the metachar ^ is handled by the function "search" detailed below.
+  Returns true if pattern can go to the Aho-Corasick automaton: a non empty string with no metachars.
+ */
+static bool is_plain(const char *pattern)
+{
+  return pattern[0] != '\0' && pattern[0] != '^' && strpbrk(pattern , ".*") == NULL ;
+}
 
-  endp is an outparamter holding the end of the regular expression match.
+/*
+  Builds the Aho-Corasick automaton of the npatterns plain strings in patterns, numbered by ids.
+  The trie is built first, then a breadth first pass sets the failure links and completes go along them,
+  so that matching takes exactly one table lookup per byte.
  */
-bool regex_match(const char *input, const char *pattern, const char **endp)
+static struct ac *ac_build(char **patterns, const int *ids, int npatterns)
 {
-    // when the entire pattern is matched, we are done.
-    if (pattern[0] == '\0') {
-        *endp = input;
-        return true;
+  struct ac *ac = calloc(1 , sizeof(struct ac)) ;
+  if(ac == NULL) error(1,0,"Allocation failure") ;
+
+  size_t space = 1 ; // nodes needed at most, one per pattern char plus the root
+  ac->nclasses = 1 ;
+  for(int k = 0 ; k < npatterns ; k++){
+    for(const unsigned char *p = (const unsigned char*)patterns[k] ; *p ; p++){
+      if(ac->classes[*p] == 0) ac->classes[*p] = ac->nclasses++ ;
+      space++ ;
     }
+  }
 
-    if(pattern[1]=='*'){
+  int nc = ac->nclasses ;
+  ac->go = malloc(sizeof(int)*space*nc) ;
+  ac->match = malloc(sizeof(int)*space) ;
+  ac->dict = malloc(sizeof(int)*space) ;
+  ac->depth = malloc(sizeof(int)*space) ;
+  int *fail = malloc(sizeof(int)*space) , *queue = malloc(sizeof(int)*space) ;
+  if(ac->go == NULL || ac->match == NULL || ac->dict == NULL || ac->depth == NULL || fail == NULL || queue == NULL)
+    error(1,0,"Allocation failure") ;
+  memset(ac->go , -1 , sizeof(int)*space*nc) ;
 
-      if(input[0]==pattern[0] || (pattern[0]=='.' && input[0]!='\0')){
-	// try a single copy of the char and recurse not advancing pattern (so as to allow for multiple copies of the char)
-	if(regex_match(input+1 , pattern , endp)) return true ;
+  ac->nnodes = 1 ;
+  ac->match[0] = ac->dict[0] = -1 ;
+  ac->depth[0] = 0 ;
+  for(int k = 0 ; k < npatterns ; k++){ // build the trie
+    int u = 0 ;
+    for(const unsigned char *p = (const unsigned char*)patterns[k] ; *p ; p++){
+      int *next = &ac->go[u*nc+ac->classes[*p]] ;
+      if(*next < 0){
+        *next = ac->nnodes++ ;
+        ac->match[*next] = -1 ;
+        ac->depth[*next] = ac->depth[u]+1 ;
+      }
+      u = *next ;
+    }
+    if(ac->match[u] < 0 || ids[k] < ac->match[u]) ac->match[u] = ids[k] ;
+    if(ac->depth[u] > ac->maxdepth) ac->maxdepth = ac->depth[u] ;
+  }
 
+  int head = 0 , tail = 0 ;
+  for(int c = 0 ; c < nc ; c++){
+    int v = ac->go[c] ;
+    if(v < 0){
+      ac->go[c] = 0 ;
+    }else{
+      fail[v] = 0 ;
+      ac->dict[v] = -1 ;
+      queue[tail++] = v ;
+    }
+  }
+  while(head < tail){ // breadth first, so the row of fail[u] is complete before u's
+    int u = queue[head++] ;
+    for(int c = 0 ; c < nc ; c++){
+      int v = ac->go[u*nc+c] , f = ac->go[fail[u]*nc+c] ;
+      if(v < 0){
+        ac->go[u*nc+c] = f ;
+      }else{
+        fail[v] = f ;
+        ac->dict[v] = (ac->match[f] >= 0) ? f : ac->dict[f] ;
+        queue[tail++] = v ;
       }
-      if(regex_match(input , pattern+2 , endp)) return true ; // try 0 copies this time.
-      else return false ; // neither 0 nor many copies worked
     }
+  }
+
+  free(fail) ;
+  free(queue) ;
+  return ac ;
+}
 
-    // match a single char or the meta .
-    if (input[0] == pattern[0] || (pattern[0]=='.' && input[0] !='\0')) {
-      return regex_match(input + 1, pattern + 1, endp);
-    }    
+/*
+  Runs the Aho-Corasick automaton over the len chars at input. Returns true if one of its patterns occurs in it.
+  Unless any is set the leftmost-longest occurrence is found: startp, endp and patternp are outparameters holding its
+  bounds and the lowest pattern with those bounds. The scan stops once no later occurrence could start early enough.
+ */
+static bool ac_search(const struct ac *ac, const char *input, size_t len, bool any, const char **startp, const char **endp, int *patternp)
+{
+  int u = 0 , best = -1 , nc = ac->nclasses ;
+  size_t beststart = 0 , bestend = 0 ;
 
-    // match failed
-    return false;
+  for(size_t i = 0 ; i < len ; i++){
+    if(best >= 0 && i+1 > beststart+ac->maxdepth) break ;
+    u = ac->go[u*nc+ac->classes[(unsigned char)input[i]]] ;
+    for(int v = (ac->match[u] >= 0) ? u : ac->dict[u] ; v >= 0 ; v = ac->dict[v]){ // every pattern ending here
+      if(any) return true ;
+      size_t start = i+1-ac->depth[v] ;
+      if(best < 0 || start < beststart || (start == beststart && (i+1 > bestend || (i+1 == bestend && ac->match[v] < best)))){
+        beststart = start ;
+        bestend = i+1 ;
+        best = ac->match[v] ;
+      }
+    }
+  }
+
+  if(best < 0) return false ;
+  *startp = input+beststart ;
+  *endp = input+bestend ;
+  *patternp = best ;
+  return true ;
 }
 
 /*
-  Runs regular expression matching on the char* input according to the regex stored in pattern.
-  Returns a * to the begining of the regex match or null if there is no match.
-  **endp is an outparameter which keeps track of the end of the regex match if it exists.
-  
-  range is used to properly itterate over all possible positions that the regex match cold start at
-  NOTE that if the metachar ^ is present, range is set to 0 as the only valid place for the match to start at is index 0.
+  Takes as input a compiled regex to fill in and the npatterns patterns to compile, numbered by their position in patterns.
+  Handles the leading metachar ^ of each. With several patterns the plain strings go to the Aho-Corasick automaton
+  and the rest to a single combined NFA.
+ */
+void regex_compile(struct regex *re, char **patterns, int npatterns)
+{
+  memset(re , 0 , sizeof(struct regex)) ;
+  bool *plain = malloc(sizeof(bool)*(npatterns+1)) ;
+  int *ids = malloc(sizeof(int)*(npatterns+1)) ;
+  char **strings = malloc(sizeof(char*)*(npatterns+1)) ;
+  if(plain == NULL || ids == NULL || strings == NULL) error(1,0,"Allocation failure") ;
 
-  patternoffset is set to 1 if the pattern uses the metachar ^ to remove it from the pattern being serched for and is 0 otherwise.
+  size_t natoms = 0 ;
+  int nplain = 0 ;
+  for(int k = 0 ; k < npatterns ; k++){
+    plain[k] = npatterns > 1 && is_plain(patterns[k]) ;
+    if(plain[k]){
+      ids[nplain] = k ;
+      strings[nplain++] = patterns[k] ;
+    }else{
+      natoms += strlen(patterns[k])+1 ;
+    }
+  }
+
+  struct nfa *fwd = &re->fwd ;
+  fwd->atoms = malloc(sizeof(struct atom)*(natoms+1)) ;
+  fwd->starts = malloc(sizeof(int)*(npatterns+1)) ;
+  fwd->bol = malloc(sizeof(bool)*(npatterns+1)) ;
+  if(fwd->atoms == NULL || fwd->starts == NULL || fwd->bol == NULL) error(1,0,"Allocation failure") ;
+  re->anchored = true ;
+  for(int k = 0 ; k < npatterns ; k++){
+    if(plain[k]) continue ;
+    bool bol = (patterns[k][0] == '^') ;
+    nfa_add(fwd , patterns[k]+(bol ? 1 : 0) , k , bol) ;
+    if(!bol) re->anchored = false ;
+  }
+  re->nregex = fwd->npatterns ;
+
+  if(re->nregex > 0){
+    nfa_reverse(&re->rev , fwd) ;
+    dfa_init(&re->find , &re->fwd , true) ;
+    dfa_init(&re->first , &re->rev , true) ;
+    dfa_init(&re->extend , &re->fwd , false) ;
+  }
+  if(nplain > 0) re->ac = ac_build(strings , ids , nplain) ;
+  if(npatterns == 1) extract_literal(re) ;
+
+  free(plain) ;
+  free(ids) ;
+  free(strings) ;
+}
+
+/*
+  Fills in dst as a copy of the compiled src for another thread. The NFAs and the Aho-Corasick automaton are read only
+  and shared, the DFA caches are written while matching so dst gets its own.
  */
-const char *search(const char *input, const char *pattern, const char **endp)
+void regex_clone(struct regex *dst, const struct regex *src)
 {
-  int range = (pattern[0]=='^')? 0 : strlen(input);
-  int patternoffset = (!range) ? 1 : 0;
-  for(int i = 0 ; i <=range ; i++){
-        if (regex_match(input + i, pattern+patternoffset, endp)) {
-            return input + i;
-        }
+  *dst = *src ;
+  if(dst->nregex > 0){
+    dfa_init(&dst->find , &dst->fwd , true) ;
+    dfa_init(&dst->first , &dst->rev , true) ;
+    dfa_init(&dst->extend , &dst->fwd , false) ;
+  }
+}
+
+/*
+  Frees the DFA caches of a regex filled in by regex_clone, leaving the NFAs and the automaton it shares with the original.
+ */
+void regex_free_clone(struct regex *re)
+{
+  if(re->nregex > 0){
+    dfa_free(&re->find) ;
+    dfa_free(&re->first) ;
+    dfa_free(&re->extend) ;
+  }
+}
+
+/*
+  Frees everything regex_compile allocated for re. Its clones must have been freed first.
+ */
+void regex_free(struct regex *re)
+{
+  regex_free_clone(re) ;
+  free(re->fwd.atoms) ;
+  free(re->fwd.starts) ;
+  free(re->fwd.bol) ;
+  free(re->rev.atoms) ; // the reversed NFA shares starts and bol with fwd
+  if(re->ac != NULL){
+    free(re->ac->go) ;
+    free(re->ac->match) ;
+    free(re->ac->dict) ;
+    free(re->ac->depth) ;
+    free(re->ac) ;
+  }
+  free(re->literal) ;
+}
+
+/*
+  Anchored leftmost-longest matching of the regex starting exactly at input, which holds len chars.
+  bol tells whether input is the begining of the line, which is the only place ^ patterns may start.
+  Returns true if there is a match, endp is an outparameter holding the end of the longest match
+  and patternp the lowest pattern matching up to there.
+  Runs the anchored DFA until it dies, remembering the last accepting position.
+ */
+bool regex_match(struct regex *re, const char *input, size_t len, bool bol, const char **endp, int *patternp)
+{
+  struct dfa *d = &re->extend ;
+  int s = bol ? d->start : d->start_mid ;
+  const char *last = NULL ;
+  if(d->flags[s] & DFA_ACCEPT){
+    last = input ;
+    *patternp = d->pattern[s] ;
+  }
+
+  for(size_t i = 0 ; i < len ; i++){
+    s = dfa_next(d , s , input[i]) ;
+    if(d->flags[s] & DFA_DEAD) break ;
+    if(d->flags[s] & DFA_ACCEPT){
+      last = input+i+1 ;
+      *patternp = d->pattern[s] ;
+    }
+  }
+
+  *endp = last ;
+  return last != NULL ;
+}
+
+/*
+  Returns true if the len chars at input contain a match of one of the NFA's patterns.
+  This is the forward pass of dfa_search on its own.
+ */
+static bool dfa_find(struct regex *re, const char *input, size_t len)
+{
+  struct dfa *d = &re->find ;
+  int s = d->start ;
+  if(d->flags[s] & DFA_ACCEPT) return true ; // the empty string matches
+  for(size_t i = 0 ; i < len ; i++){
+    s = dfa_next(d , s , input[i]) ;
+    if(d->flags[s] & DFA_ACCEPT) return true ;
+    if(d->flags[s] & DFA_DEAD) return false ; // only ^ patterns, which can no longer match
+  }
+  return false ;
+}
+
+/*
+  Returns true if the len chars at input contain a match of re,
+  which is all that is needed when the match does not have to be located (counting, or printing without emphasis).
+ */
+bool regex_find(struct regex *re, const char *input, size_t len)
+{
+  const char *start , *end ;
+  int pattern ;
+  if(re->nregex > 0 && dfa_find(re , input , len)) return true ;
+  return re->ac != NULL && ac_search(re->ac , input , len , true , &start , &end , &pattern) ;
+}
+
+/*
+  Leftmost-longest match of the NFA's patterns in the len chars at input, see search.
+
+  Every line costs one forward pass (dfa_find) to find out whether it matches. Matching lines then take a reverse pass
+  from the end of the line, whose last accepting position is the leftmost place a match can start,
+  and a forward anchored pass from there for the longest match. All three passes are linear in the line length.
+ */
+static const char *dfa_search(struct regex *re, const char *input, size_t len, const char **endp, int *patternp)
+{
+  if(re->anchored) return regex_match(re , input , len , true , endp , patternp) ? input : NULL ;
+  if(!dfa_find(re , input , len)) return NULL ;
+
+  size_t start = 0 ;
+  if(!(re->find.flags[re->find.start] & DFA_ACCEPT)){ // if the empty string matches, the leftmost match starts at offset 0
+    struct dfa *d = &re->first ;
+    int s = d->start ;
+    start = len ;
+    for(size_t i = len ; i > 0 ; i--){
+      s = dfa_next(d , s , input[i-1]) ;
+      if((d->flags[s] & DFA_ACCEPT) || (i == 1 && (d->flags[s] & DFA_ACCEPT_BOL))) start = i-1 ;
     }
-    *endp = NULL;
-    return NULL;
+  }
+
+  regex_match(re , input+start , len-start , start == 0 , endp , patternp) ;
+  return input+start ;
+}
+
+/*
+  Runs regular expression matching on the len chars at input according to the compiled regex re.
+  input does not need to be NUL terminated, so lines are matched in place in the mapped file.
+  Returns a * to the begining of the leftmost regex match or null if there is no match.
+  **endp is an outparameter which keeps track of the end of the (longest) regex match if it exists,
+  and patternp of the pattern that matched (the lowest one if there are several with the same bounds).
+  With -f the matches of the combined NFA and of the Aho-Corasick automaton are compared to pick the overall one.
+ */
+const char *search(struct regex *re, const char *input, size_t len, const char **endp, int *patternp)
+{
+  const char *start = NULL , *acstart , *acend ;
+  int acpattern ;
+  *endp = NULL ;
+  *patternp = -1 ;
+
+  if(re->nregex > 0) start = dfa_search(re , input , len , endp , patternp) ;
+  if(re->ac != NULL && ac_search(re->ac , input , len , false , &acstart , &acend , &acpattern)){
+    if(start == NULL || acstart < start || (acstart == start && (acend > *endp || (acend == *endp && acpattern < *patternp)))){
+      start = acstart ;
+      *endp = acend ;
+      *patternp = acpattern ;
+    }
+  }
+  return start ;
+}
+
+/*
+  What mygrep prints: every matching line, only a count of matching lines per file (-c),
+  or only the names of the files that have a matching line (-l).
+ */
+enum mode { MODE_PRINT , MODE_COUNT , MODE_LIST };
+
+/*
+  Buffered output. Text is appended to buf, which is written to fd with write whenever it fills up (OUTBUF_SIZE bytes).
+  With fd -1 nothing is written and buf just grows, which is how the jobs of a parallel run hold on to their output
+  until the main thread gets to them.
+  emphasis, numbered (-f, prefix each line with the number of the pattern that matched it) and mode say how matches
+  are printed, count is the number of matching lines seen since the caller last reset it.
+ */
+struct output {
+  char *buf ;
+  size_t len , space ;
+  int fd ;
+  bool emphasis , numbered ;
+  enum mode mode ;
+  size_t count ;
+};
+
+void out_init(struct output *out, int fd, bool emphasis, bool numbered, enum mode mode)
+{
+  out->fd = fd ;
+  out->emphasis = emphasis ;
+  out->numbered = numbered ;
+  out->mode = mode ;
+  out->len = out->count = 0 ;
+  out->space = (fd >= 0) ? OUTBUF_SIZE : 0 ;
+  out->buf = (fd >= 0) ? malloc(out->space) : NULL ;
+  if(fd >= 0 && out->buf == NULL) error(1,0,"Allocation failure") ;
+}
+
+/*
+  Writes the n bytes at buf to fd, retrying on short writes.
+ */
+static void write_all(int fd, const char *buf, size_t n)
+{
+  while(n > 0){
+    ssize_t nwritten = write(fd , buf , n) ;
+    if(nwritten < 0){
+      if(errno == EINTR) continue ;
+      error(1,errno,"write error") ;
+    }
+    buf += nwritten ;
+    n -= nwritten ;
+  }
+}
+
+void out_flush(struct output *out)
+{
+  if(out->fd < 0) return ;
+  write_all(out->fd , out->buf , out->len) ;
+  out->len = 0 ;
+}
+
+/*
+  Appends the n bytes at s to out. Blocks too large for the buffer are written straight through.
+ */
+void out_write(struct output *out, const char *s, size_t n)
+{
+  if(n == 0) return ;
+  if(out->len+n > out->space){
+    if(out->fd >= 0){
+      out_flush(out) ;
+      if(n >= out->space){
+        write_all(out->fd , s , n) ;
+        return ;
+      }
+    }else{
+      size_t space = 2*out->space ;
+      if(space < out->len+n) space = out->len+n ;
+      if(space < 4096) space = 4096 ;
+      out->buf = realloc(out->buf , space) ;
+      if(out->buf == NULL) error(1,0,"Allocation failure") ;
+      out->space = space ;
+    }
+  }
+  memcpy(out->buf+out->len , s , n) ;
+  out->len += n ;
+}
+
+static inline void out_puts(struct output *out, const char *s)
+{
+  out_write(out , s , strlen(s)) ;
 }
 
 /*
   Prints out a string with the regex match highlighted.
  */
-void print_with_emphasis(const char *cur, const char *start, const char *end)
+void print_with_emphasis(struct output *out, const char *cur, const char *start, const char *end)
+{
+  out_write(out , cur , start-cur) ;
+  out_puts(out , OPEN_EMPHASIS) ;
+  out_write(out , start , end-start) ;
+  out_puts(out , CLOSE_EMPHASIS) ;
+}
+
+/*
+  Runs a search on the given line of len chars to determine if it contains a match to the pattern.
+  If it does contain a match prints it to out with the filename present if mygrep was called with multiple files to be searched.
+  Returns true if the line matches.
+  Only the default mode with emphasis (or -f's pattern numbers) needs the match located, otherwise the forward pass
+  alone decides and the line is printed as is (or not at all with -c and -l).
+ */
+bool print_match(struct output *out, const char *line, size_t len, struct regex *re, const char *filename)
+{
+  const char *start = NULL , *end = NULL ;
+  int pattern = -1 ;
+
+  if(out->mode == MODE_PRINT && (out->emphasis || out->numbered)) start = search(re , line , len , &end , &pattern) ;
+  else if(regex_find(re , line , len)) start = end = line ;
+  if(start == NULL) return false ;
+
+  out->count++ ;
+  if(out->mode != MODE_PRINT) return true ;
+
+  if(filename != NULL){
+    out_puts(out , filename) ;
+    out_write(out , ": " , 2) ;
+  }
+  if(out->numbered){
+    char num[32] ;
+    out_write(out , num , snprintf(num , sizeof(num) , "%d: " , pattern+1)) ;
+  }
+  if(out->emphasis) print_with_emphasis(out , line , start , end) ;
+  else end = line ;
+  out_write(out , end , line+len-end) ;
+  out_write(out , "\n" , 1) ;
+  return true ;
+}
+
+/*
+  Prints the per file result of -c (the count of matching lines, prefixed by filename if there are several files)
+  and -l (path if the file has a matching line). Prints nothing in the default mode.
+ */
+void print_summary(struct output *out, const char *path, const char *filename, size_t count)
+{
+  if(out->mode == MODE_COUNT){
+    char num[32] ;
+    if(filename != NULL){
+      out_puts(out , filename) ;
+      out_write(out , ": " , 2) ;
+    }
+    out_write(out , num , snprintf(num , sizeof(num) , "%zu\n" , count)) ;
+  }else if(out->mode == MODE_LIST && count > 0){
+    out_puts(out , path) ;
+    out_write(out , "\n" , 1) ;
+  }
+}
+
+/*
+  Splits the len bytes at buf into lines with memchr and matches each one in place.
+  Returns the number of bytes consumed. Unless last is set, a trailing line without a newline is left
+  unconsumed as more of it may still be coming. With -l the rest of the buffer is skipped after the first match.
+
+  When the pattern has a required literal the buffer is not split into lines up front. The literal is searched
+  for across the whole buffer, and only the line around each occurrence is handed to the regex engine,
+  so lines without a candidate cost nothing beyond the substring scan.
+ */
+size_t grep_buffer(struct output *out, const char *buf, size_t len, bool last, struct regex *re, const char *filename)
+{
+  const char *cur = buf , *end = buf+len ;
+
+  if(!last){ // only complete lines are searched
+    const char *nl = memrchr(buf , '\n' , len) ;
+    end = (nl == NULL) ? buf : nl+1 ;
+  }
+
+  while(cur < end){
+    const char *bol = cur , *eol ;
+    if(re->litlen > 0){
+      const char *hit = find_literal(re , cur , end-cur) ;
+      if(hit == NULL) break ;
+      bol = memrchr(cur , '\n' , hit-cur) ;
+      bol = (bol == NULL) ? cur : bol+1 ;
+      eol = memchr(hit , '\n' , end-hit) ;
+    }else{
+      eol = memchr(cur , '\n' , end-cur) ;
+    }
+    if(eol == NULL) eol = end ; // the last line might not have a newline
+
+    if(print_match(out , bol , eol-bol , re , filename) && out->mode == MODE_LIST) break ;
+    cur = eol+1 ;
+  }
+  return end-buf ;
+}
+
+/*
+  Goes line by line through the file fd and trys to find a match to the regex pattern on that line.
+  If a match is present, it prints the match to out.
+  Regular files are memory mapped and searched in place. Anything else (stdin, pipes) is read in READ_CHUNK
+  sized reads into a buffer that grows when a single line does not fit, so there is no limit on line length.
+ */
+void grep_file(struct output *out, int fd, struct regex *re, const char *filename)
+{
+  struct stat st ;
+  if(fstat(fd , &st) == 0 && S_ISREG(st.st_mode)){
+    if(st.st_size == 0) return ;
+    char *map = mmap(NULL , st.st_size , PROT_READ , MAP_PRIVATE , fd , 0) ;
+    if(map != MAP_FAILED){
+      madvise(map , st.st_size , MADV_SEQUENTIAL) ;
+      grep_buffer(out , map , st.st_size , true , re , filename) ;
+      munmap(map , st.st_size) ;
+      return ;
+    }
+  }
+
+  size_t space = READ_CHUNK , used = 0 ;
+  char *buf = malloc(space) ;
+  if(buf == NULL) error(1,0,"Allocation failure") ;
+
+  while(1){
+    if(space-used < READ_CHUNK/2){ // a long line is filling the buffer, make room for more of it
+      space *= 2 ;
+      buf = realloc(buf , space) ;
+      if(buf == NULL) error(1,0,"Allocation failure") ;
+    }
+    ssize_t nread = read(fd , buf+used , space-used) ;
+    if(nread < 0) error(1,errno,"%s: read error" , filename != NULL ? filename : "(standard input)") ;
+    used += nread ;
+
+    size_t done = grep_buffer(out , buf , used , nread == 0 , re , filename) ;
+    if(out->mode == MODE_LIST && out->count > 0) break ; // no need to read the rest
+    memmove(buf , buf+done , used-done) ; // keep the partial last line for the next read
+    used -= done ;
+    if(nread == 0) break ;
+  }
+  free(buf) ;
+}
+
+/*
+  Searches the lines of a mapped file of size bytes that start in the byte range [lo, hi).
+  The range does not need to be aligned to lines: a line that starts before lo is left to the range before,
+  and the line that hi falls in is searched up to its newline, so consecutive ranges cover every line exactly once.
+ */
+void grep_range(struct output *out, const char *map, size_t size, size_t lo, size_t hi, struct regex *re, const char *filename)
+{
+  const char *start = map+lo , *end = map+hi ;
+
+  if(lo > 0 && map[lo-1] != '\n'){ // skip the tail of the line the previous range is searching
+    const char *nl = memchr(start , '\n' , hi-lo) ;
+    if(nl == NULL) return ;
+    start = nl+1 ;
+  }
+  if(hi < size && map[hi-1] != '\n'){ // finish the last line started in the range
+    const char *nl = memchr(end , '\n' , size-hi) ;
+    end = (nl == NULL) ? map+size : nl+1 ;
+  }
+  if(start < end) grep_buffer(out , start , end-start , true , re , filename) ;
+}
+
+/*
+  One unit of work of a parallel run: a whole file, or when chunk is set the byte range [lo, hi) of a large one.
+  file is the index of the file in argv order. The worker that claims the job searches it into its own in memory output
+  and sets done, the main thread then writes the buffered output in argv (and file) order.
+  err holds the errno of a failed open, reported by the main thread when it gets to this job.
+ */
+struct job {
+  const char *path , *filename ;
+  int file ;
+  bool chunk ;
+  size_t lo , hi ;
+  struct output out ;
+  int err ;
+  bool done ;
+};
+
+/*
+  listed has an entry per file, set once a job of that file has found a match with -l so that
+  its remaining chunks can be skipped.
+ */
+struct pool {
+  struct job *jobs ;
+  int njobs , next ; // next is the first job no worker has claimed yet
+  int written , ahead ; // jobs the main thread has written out, and how many more may be claimed past that
+  const struct regex *re ;
+  bool *listed ;
+  pthread_mutex_t lock ;
+  pthread_cond_t done ;
+};
+
+/*
+  Searches the file or the file range of job into its output.
+ */
+void run_job(struct job *job, struct regex *re)
 {
-    int nbefore = start - cur;
-    int nmatched = end - start;
-    printf("%.*s%s%.*s%s", nbefore, cur, OPEN_EMPHASIS,
-        nmatched, start, CLOSE_EMPHASIS);
+  int fd = open(job->path , O_RDONLY) ;
+  if(fd < 0){
+    job->err = errno ;
+    return ;
+  }
+
+  if(!job->chunk){
+    grep_file(&job->out , fd , re , job->filename) ;
+  }else{
+    struct stat st ;
+    char *map = MAP_FAILED ;
+    if(fstat(fd , &st) == 0 && (size_t)st.st_size >= job->hi)
+      map = mmap(NULL , st.st_size , PROT_READ , MAP_PRIVATE , fd , 0) ;
+    if(map == MAP_FAILED){
+      job->err = errno ;
+    }else{
+      madvise(map+(job->lo & ~(size_t)4095) , job->hi-(job->lo & ~(size_t)4095) , MADV_SEQUENTIAL) ;
+      grep_range(&job->out , map , st.st_size , job->lo , job->hi , re , job->filename) ;
+      munmap(map , st.st_size) ;
+    }
+  }
+  close(fd) ;
 }
 
 /*
-  Runs a search on the given word to determine if it contains a match to the pattern.
-  If it does contain a match prints it out with the filename present if mygrep was called with multiple files to be searched.
+  Worker thread of a -j run. Makes its own copy of the compiled patterns (the DFA caches are filled in while matching,
+  so they cannot be shared between threads) and keeps claiming the next unsearched job until there are none left.
+  Workers wait instead of running more than ahead jobs past the output written so far, which bounds the memory held
+  in output buffers when an early job is slow.
  */
-void print_match(const char *line, const char *pattern, const char *filename)
+void *grep_worker(void *arg)
 {
-    const char *end = NULL;
-    const char *start = search(line, pattern, &end);
+  struct pool *pool = arg ;
+  struct regex re ;
+  regex_clone(&re , pool->re) ;
+
+  while(1){
+    pthread_mutex_lock(&pool->lock) ;
+    while(pool->next < pool->njobs && pool->next >= pool->written+pool->ahead)
+      pthread_cond_wait(&pool->done , &pool->lock) ;
+    int i = pool->next++ ;
+    bool skip = i < pool->njobs && pool->listed[pool->jobs[i].file] ; // -l already has its answer for this file
+    pthread_mutex_unlock(&pool->lock) ;
+    if(i >= pool->njobs) break ;
+
+    struct job *job = &pool->jobs[i] ;
+    if(!skip) run_job(job , &re) ;
+
+    pthread_mutex_lock(&pool->lock) ;
+    if(job->out.mode == MODE_LIST && job->out.count > 0) pool->listed[job->file] = true ;
+    job->done = true ;
+    pthread_cond_broadcast(&pool->done) ;
+    pthread_mutex_unlock(&pool->lock) ;
+  }
+  regex_free_clone(&re) ;
+  return NULL ;
+}
+
+/*
+  Searches the nfiles files in paths on njobs threads, writing to out. Output is written in the order of paths as soon as
+  every file before it has been written, so it is identical to a single threaded run.
+  Regular files larger than two PARALLEL_CHUNKs are split into PARALLEL_CHUNK sized ranges that are searched
+  concurrently as well, so a single huge file keeps every thread busy. Counts for -c and -l are summed over the chunks.
+ */
+void grep_parallel(struct output *out, char *paths[], int nfiles, const struct regex *re, int njobs)
+{
+  struct pool pool = { .njobs = 0 , .next = 0 , .written = 0 , .ahead = JOBS_AHEAD*njobs , .re = re } ;
+  int space = nfiles ;
+  pool.jobs = malloc(space*sizeof(struct job)) ;
+  pool.listed = calloc(nfiles , sizeof(bool)) ;
+  if(pool.jobs == NULL || pool.listed == NULL) error(1,0,"Allocation failure") ;
+
+  for(int i = 0 ; i < nfiles ; i++){
+    struct stat st ;
+    size_t size = 0 , nchunks = 1 ;
+    if(stat(paths[i] , &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 2*PARALLEL_CHUNK){
+      size = st.st_size ;
+      nchunks = (size+PARALLEL_CHUNK-1)/PARALLEL_CHUNK ;
+    }
+    if(pool.njobs+nchunks > (size_t)space){
+      space = 2*(pool.njobs+nchunks) ;
+      pool.jobs = realloc(pool.jobs , space*sizeof(struct job)) ;
+      if(pool.jobs == NULL) error(1,0,"Allocation failure") ;
+    }
+    for(size_t c = 0 ; c < nchunks ; c++){
+      struct job *job = &pool.jobs[pool.njobs++] ;
+      memset(job , 0 , sizeof(struct job)) ;
+      job->path = paths[i] ;
+      job->filename = nfiles > 1 ? paths[i] : NULL ;
+      job->file = i ;
+      job->chunk = nchunks > 1 ;
+      job->lo = c*PARALLEL_CHUNK ;
+      job->hi = (c == nchunks-1) ? size : (c+1)*PARALLEL_CHUNK ;
+      out_init(&job->out , -1 , out->emphasis , out->numbered , out->mode) ;
+    }
+  }
+  pthread_mutex_init(&pool.lock , NULL) ;
+  pthread_cond_init(&pool.done , NULL) ;
+
+  if(njobs > pool.njobs) njobs = pool.njobs ;
+  pthread_t threads[njobs] ;
+  for(int t = 0 ; t < njobs ; t++) pthread_create(&threads[t] , NULL , grep_worker , &pool) ;
+
+  size_t count = 0 ; // matching lines of the current file so far
+  for(int i = 0 ; i < pool.njobs ; i++){
+    struct job *job = &pool.jobs[i] ;
+    pthread_mutex_lock(&pool.lock) ;
+    while(!job->done) pthread_cond_wait(&pool.done , &pool.lock) ;
+    pthread_mutex_unlock(&pool.lock) ;
+
+    if(job->err != 0){
+      out_flush(out) ;
+      error(1,0,"%s: no such file" , job->path) ;
+    }
+    out_write(out , job->out.buf , job->out.len) ;
+    free(job->out.buf) ;
+    count += job->out.count ;
+    if(i == pool.njobs-1 || pool.jobs[i+1].file != job->file){ // last job of this file
+      print_summary(out , job->path , job->filename , count) ;
+      count = 0 ;
+    }
+
+    pthread_mutex_lock(&pool.lock) ;
+    pool.written++ ;
+    pthread_cond_broadcast(&pool.done) ; // let workers waiting on the window claim more jobs
+    pthread_mutex_unlock(&pool.lock) ;
+  }
+
+  for(int t = 0 ; t < njobs ; t++) pthread_join(threads[t] , NULL) ;
+  free(pool.jobs) ;
+  free(pool.listed) ;
+}
 
-    if (start != NULL) {
-        if (filename != NULL) printf("%s: ", filename);
-        print_with_emphasis(line, start, end);
-        printf("%s\n", end);
+/*
+  A unit of work of the -r walk: a directory to read or a file to search. path is malloced and owned by the task.
+ */
+struct task {
+  char *path ;
+  bool dir ;
+};
+
+/*
+  Per worker double ended queue of tasks. The owner pushes and pops at the end (depth first, which keeps the
+  directories it just read warm), idle workers steal from the front, which hands them the largest subtrees.
+ */
+struct deque {
+  struct task *tasks ;
+  size_t head , tail , space ;
+  pthread_mutex_t lock ;
+};
+
+/*
+  Work stealing pool of the -r walk. Reading directories and searching files are both tasks, so the walk and the
+  searching overlap and a deep tree is spread over every thread. pending counts the tasks pushed but not finished,
+  the walk is over when it drops to 0. pushes counts the calls to walk_push under idle_lock, which lets an idle worker
+  tell whether a task came in since it last looked. Each searched file's output is appended to out in one piece under out_lock.
+ */
+struct walker {
+  struct deque *deques ;
+  int nworkers ;
+  atomic_long pending ;
+  pthread_mutex_t idle_lock ;
+  pthread_cond_t idle ;
+  unsigned long pushes ;
+  const struct regex *re ;
+  struct output *out ;
+  pthread_mutex_t out_lock ;
+};
+
+struct walk_worker {
+  struct walker *walker ;
+  int id ;
+};
+
+static void walk_push(struct walker *w, int id, char *path, bool dir)
+{
+  struct deque *dq = &w->deques[id] ;
+  atomic_fetch_add(&w->pending , 1) ;
+  pthread_mutex_lock(&dq->lock) ;
+  if(dq->tail == dq->space){
+    if(dq->head > 0){
+      memmove(dq->tasks , dq->tasks+dq->head , (dq->tail-dq->head)*sizeof(struct task)) ;
+      dq->tail -= dq->head ;
+      dq->head = 0 ;
     }
+    if(dq->tail == dq->space){
+      dq->space = dq->space ? 2*dq->space : 64 ;
+      dq->tasks = realloc(dq->tasks , dq->space*sizeof(struct task)) ;
+      if(dq->tasks == NULL) error(1,0,"Allocation failure") ;
+    }
+  }
+  dq->tasks[dq->tail++] = (struct task){ .path = path , .dir = dir } ;
+  pthread_mutex_unlock(&dq->lock) ;
+
+  pthread_mutex_lock(&w->idle_lock) ;
+  w->pushes++ ;
+  pthread_cond_signal(&w->idle) ;
+  pthread_mutex_unlock(&w->idle_lock) ;
 }
 
 /*
-  Goes line by line through the file fp and trys to find a match to the regex pattern on that line.
-  If a match is present, it prints the match out.
+  Takes a task from the deque of worker id, from the end if it is the owner's own (steal unset) or the front otherwise.
+  Returns false if the deque is empty.
  */
-void grep_file(FILE *fp, const char *pattern, const char *filename)
+static bool walk_pop(struct walker *w, int id, bool steal, struct task *task)
 {
-    char line[MAX_LINE_LEN];
+  struct deque *dq = &w->deques[id] ;
+  bool found = false ;
+  pthread_mutex_lock(&dq->lock) ;
+  if(dq->head < dq->tail){
+    *task = steal ? dq->tasks[dq->head++] : dq->tasks[--dq->tail] ;
+    found = true ;
+  }
+  pthread_mutex_unlock(&dq->lock) ;
+  return found ;
+}
 
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        // truncate trailing newline if present
-        // (most lines will have one, last line might not)
-        if (line[strlen(line)-1] == '\n') line[strlen(line)-1] = '\0';
-        print_match(line, pattern, filename);
+/*
+  Returns true if the first block of the file fd holds a NUL byte, which is how -r tells binary files apart.
+ */
+static bool is_binary(int fd)
+{
+  char block[SNIFF_SIZE] ;
+  ssize_t nread = pread(fd , block , sizeof(block) , 0) ;
+  return nread > 0 && memchr(block , '\0' , nread) != NULL ;
+}
+
+/*
+  Searches the file path for the -r walk into a private output, then appends it to the shared one.
+ */
+static void walk_file(struct walker *w, struct regex *re, const char *path)
+{
+  int fd = openat(AT_FDCWD , path , O_RDONLY | O_CLOEXEC) ;
+  if(fd < 0){
+    error(0,errno,"%s" , path) ;
+    return ;
+  }
+  if(!is_binary(fd)){
+    struct output out ;
+    out_init(&out , -1 , w->out->emphasis , w->out->numbered , w->out->mode) ;
+    grep_file(&out , fd , re , path) ;
+
+    pthread_mutex_lock(&w->out_lock) ;
+    out_write(w->out , out.buf , out.len) ;
+    print_summary(w->out , path , path , out.count) ;
+    pthread_mutex_unlock(&w->out_lock) ;
+    free(out.buf) ;
+  }
+  close(fd) ;
+}
+
+/*
+  Reads the directory path with getdents64 and pushes a task for every subdirectory and regular file in it.
+  Symbolic links are not followed. d_type is used when the file system provides it, fstatat relative to the
+  directory otherwise.
+ */
+static void walk_dir(struct walker *w, int id, const char *path)
+{
+  int fd = openat(AT_FDCWD , path , O_RDONLY | O_DIRECTORY | O_CLOEXEC) ;
+  if(fd < 0){
+    error(0,errno,"%s" , path) ;
+    return ;
+  }
+
+  size_t pathlen = strlen(path) ;
+  if(pathlen > 0 && path[pathlen-1] == '/') pathlen-- ; // do not double the separator
+  char *buf = malloc(DENTS_SIZE) ;
+  if(buf == NULL) error(1,0,"Allocation failure") ;
+
+  long nread ;
+  while((nread = syscall(SYS_getdents64 , fd , buf , DENTS_SIZE)) > 0){
+    for(long pos = 0 ; pos < nread ; ){
+      struct dirent64 *ent = (struct dirent64*)(buf+pos) ;
+      pos += ent->d_reclen ;
+      const char *name = ent->d_name ;
+      if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue ;
+
+      unsigned char type = ent->d_type ;
+      if(type == DT_UNKNOWN){
+        struct stat st ;
+        if(fstatat(fd , name , &st , AT_SYMLINK_NOFOLLOW) != 0) continue ;
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN ;
+      }
+      if(type != DT_DIR && type != DT_REG) continue ;
+
+      size_t namelen = strlen(name) ;
+      char *child = malloc(pathlen+namelen+2) ;
+      if(child == NULL) error(1,0,"Allocation failure") ;
+      memcpy(child , path , pathlen) ;
+      child[pathlen] = '/' ;
+      memcpy(child+pathlen+1 , name , namelen+1) ;
+      walk_push(w , id , child , type == DT_DIR) ;
+    }
+  }
+  if(nread < 0) error(0,errno,"%s" , path) ;
+  free(buf) ;
+  close(fd) ;
+}
+
+/*
+  Worker thread of the -r walk. Runs tasks from its own deque, steals from the others when it runs dry,
+  and when there is nothing to steal waits until either a task is pushed or no task is pending anywhere.
+  The push count is read before looking, so a push that lands between the steal attempts and the wait is not missed.
+ */
+void *walk_worker(void *arg)
+{
+  struct walk_worker *self = arg ;
+  struct walker *w = self->walker ;
+  struct regex re ;
+  regex_clone(&re , w->re) ;
+
+  while(1){
+    pthread_mutex_lock(&w->idle_lock) ;
+    unsigned long seen = w->pushes ;
+    pthread_mutex_unlock(&w->idle_lock) ;
+
+    struct task task ;
+    bool found = walk_pop(w , self->id , false , &task) ;
+    for(int k = 1 ; !found && k < w->nworkers ; k++) found = walk_pop(w , (self->id+k)%w->nworkers , true , &task) ;
+
+    if(!found){
+      pthread_mutex_lock(&w->idle_lock) ;
+      while(w->pushes == seen && atomic_load(&w->pending) > 0) pthread_cond_wait(&w->idle , &w->idle_lock) ;
+      bool over = atomic_load(&w->pending) == 0 ;
+      pthread_mutex_unlock(&w->idle_lock) ;
+      if(over) break ;
+      continue ;
+    }
+
+    if(task.dir) walk_dir(w , self->id , task.path) ;
+    else walk_file(w , &re , task.path) ;
+    free(task.path) ;
+    if(atomic_fetch_sub(&w->pending , 1) == 1){ // that was the last task, wake everybody up to exit
+      pthread_mutex_lock(&w->idle_lock) ;
+      pthread_cond_broadcast(&w->idle) ;
+      pthread_mutex_unlock(&w->idle_lock) ;
     }
+  }
+  regex_free_clone(&re) ;
+  return NULL ;
 }
 
 /*
-  Parses the arguments passsed to mygrep and successively opens each of the search files, tests each line for
+  Searches every regular file under the npaths paths (files or directories) on njobs threads for -r,
+  skipping binary files. Every line is prefixed by the name of its file. Each file's output is written in one piece,
+  but the files come out in the order they are finished rather than in directory order.
+ */
+void grep_recursive(struct output *out, char *paths[], int npaths, const struct regex *re, int njobs)
+{
+  struct walker w = { .nworkers = njobs , .re = re , .out = out } ;
+  atomic_init(&w.pending , 0) ;
+  w.deques = calloc(njobs , sizeof(struct deque)) ;
+  struct walk_worker *workers = malloc(njobs*sizeof(struct walk_worker)) ;
+  if(w.deques == NULL || workers == NULL) error(1,0,"Allocation failure") ;
+  for(int t = 0 ; t < njobs ; t++) pthread_mutex_init(&w.deques[t].lock , NULL) ;
+  pthread_mutex_init(&w.idle_lock , NULL) ;
+  pthread_cond_init(&w.idle , NULL) ;
+  pthread_mutex_init(&w.out_lock , NULL) ;
+
+  for(int i = 0 ; i < npaths ; i++){
+    struct stat st ;
+    if(stat(paths[i] , &st) != 0) error(1,0,"%s: no such file" , paths[i]) ;
+    char *path = strdup(paths[i]) ;
+    if(path == NULL) error(1,0,"Allocation failure") ;
+    walk_push(&w , i%njobs , path , S_ISDIR(st.st_mode)) ;
+  }
+
+  pthread_t threads[njobs] ;
+  for(int t = 0 ; t < njobs ; t++){
+    workers[t] = (struct walk_worker){ .walker = &w , .id = t } ;
+    pthread_create(&threads[t] , NULL , walk_worker , &workers[t]) ;
+  }
+  for(int t = 0 ; t < njobs ; t++) pthread_join(threads[t] , NULL) ;
+
+  for(int t = 0 ; t < njobs ; t++) free(w.deques[t].tasks) ;
+  free(w.deques) ;
+  free(workers) ;
+}
+
+/*
+  Reads the patterns of -f from the file path, one per line. Returns them and sets npatterns to how many there are.
+ */
+char **read_patterns(const char *path, int *npatterns)
+{
+  FILE *fp = fopen(path , "r") ;
+  if(fp == NULL) error(1,0,"%s: no such file" , path) ;
+
+  char **patterns = NULL , *line = NULL ;
+  size_t linesz = 0 ;
+  int n = 0 , space = 0 ;
+  ssize_t len ;
+  while((len = getline(&line , &linesz , fp)) != -1){
+    if(len > 0 && line[len-1] == '\n') line[len-1] = '\0' ;
+    if(n == space){
+      space = space ? 2*space : 64 ;
+      patterns = realloc(patterns , space*sizeof(char*)) ;
+      if(patterns == NULL) error(1,0,"Allocation failure") ;
+    }
+    patterns[n++] = strdup(line) ;
+  }
+  free(line) ;
+  fclose(fp) ;
+  *npatterns = n ;
+  return patterns ;
+}
+
+#ifndef MYGREP_NO_MAIN // defined by grepbench.c, which includes this file to drive the matcher directly
+/*
+  Parses the arguments passsed to mygrep, compiles the pattern and successively opens each of the search files, tests each line for
   a regex match and prints out that match if it exists.
+  -j N searches the files, and ranges of large files, on N threads.
+  -c prints only the number of matching lines of each file and -l only the names of the files with a match.
+  -f FILE takes the patterns from FILE, one per line, instead of PATTERN. Every line matching any of them is printed
+  once, prefixed by the number of the pattern (its line in FILE) that matched.
+  -r searches every file under the FILEs that are directories (the current directory if there are none).
+  Matches are only highlighted when stdout is a terminal.
  */
 int main(int argc, char *argv[])
 {
-    if (argc < 2) error(1, 0, "Usage: mygrep PATTERN [FILE]...");
-    const char *pattern = argv[1];
+    const char *usage = "Usage: mygrep [-c | -l] [-r] [-j N] (PATTERN | -f FILE) [FILE]...";
+    enum mode mode = MODE_PRINT;
+    const char *patternfile = NULL;
+    bool recursive = false;
+    int njobs = 1, opt;
+    while ((opt = getopt(argc, argv, "+clrj:f:")) != -1) {
+        if (opt == 'j' && atoi(optarg) > 0) njobs = atoi(optarg);
+        else if (opt == 'c' && mode != MODE_LIST) mode = MODE_COUNT;
+        else if (opt == 'l') mode = MODE_LIST;
+        else if (opt == 'f') patternfile = optarg;
+        else if (opt == 'r') recursive = true;
+        else error(1, 0, "%s", usage);
+    }
 
-    if (argc == 2) {
-        grep_file(stdin, pattern, NULL);
+    char **patterns = argv + optind;
+    int npatterns = 1;
+    if (patternfile != NULL) patterns = read_patterns(patternfile, &npatterns);
+    else if (optind++ >= argc) error(1, 0, "%s", usage);
+    char **files = argv + optind;
+    int nfiles = argc - optind;
+
+    struct regex re;
+    regex_compile(&re, patterns, npatterns);
+    if (patternfile != NULL) {
+        for (int k = 0; k < npatterns; k++) free(patterns[k]);
+        free(patterns);
+    }
+    select_find_literal();
+
+    struct output out;
+    out_init(&out, STDOUT_FILENO, isatty(STDOUT_FILENO), patternfile != NULL, mode);
+
+    if (recursive) {
+        char *here[] = { "." };
+        if (nfiles == 0) grep_recursive(&out, here, 1, &re, njobs);
+        else grep_recursive(&out, files, nfiles, &re, njobs);
+    } else if (njobs > 1 && nfiles > 0) {
+        grep_parallel(&out, files, nfiles, &re, njobs);
+    } else if (nfiles == 0) {
+        grep_file(&out, STDIN_FILENO, &re, NULL);
+        print_summary(&out, "(standard input)", NULL, out.count);
     } else {
-        for (int i = 2; i < argc; i++) {
-            FILE *fp = fopen(argv[i], "r");
-            if (fp == NULL) error(1, 0, "%s: no such file", argv[i]);
-            grep_file(fp, pattern, argc > 3 ? argv[i] : NULL);
-            fclose(fp);
+        for (int i = 0; i < nfiles; i++) {
+            int fd = open(files[i], O_RDONLY);
+            if (fd < 0) {
+                out_flush(&out);
+                error(1, 0, "%s: no such file", files[i]);
+            }
+            out.count = 0;
+            grep_file(&out, fd, &re, nfiles > 1 ? files[i] : NULL);
+            print_summary(&out, files[i], nfiles > 1 ? files[i] : NULL, out.count);
+            close(fd);
         }
     }
+    out_flush(&out);
+    free(out.buf);
+    regex_free(&re);
     return 0;
 }
-
+#endif
@@ -1,85 +1,724 @@
+/*
+  mywhich, a which(1) that indexes the PATH directories, optionally in a cache file or a resident server.
+  See main for the flags.
 
+  Build: gcc -O2 -o mywhich mywhich.c map.c allocator.c
+  Usage: mywhich [-a] [-p PATHS] [-c CACHEFILE] [-s SOCKET | -S SOCKET] [PROGRAM]...
+ */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <error.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#include "cmap.h"
+
+#define CACHE_MAGIC "mywhich cache 1\n"
+#define BATCH_READ (1<<16) // read size of the names read from stdin in batch mode
+#define USAGE "Usage: mywhich [-a] [-p PATHS] [-c CACHEFILE] [-s SOCKET | -S SOCKET] [PROGRAM]..."
+#define REQ_FIRST '1' // first byte of a request to the server, followed by the header and the names, for the first match of each
+#define REQ_ALL 'a' // same, for every match (-a)
+#define REPLY_OK '+' // first byte of the answer of the server to a client with its PATH, followed by the matches
+#define REPLY_OTHER '-' // the whole answer to a client with another PATH, which looks the names up itself
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/*
+  One directory of the PATH. index maps the name of every entry of the directory to its d_type and is only built
+  the first time a lookup reaches the directory, either by reading the directory or from the cache file if the
+  cached copy has the directory's current mtime. dirty is set when the index was read from the directory,
+  meaning the cache file needs to be rewritten.
+  fd is the directory, opened once along with the index (-1 if it cannot be opened), that candidates are probed relative to.
+  unindexed is set for a directory that can be searched but not read (mode 711), whose empty index says nothing: fd is an
+  O_PATH descriptor and every name is probed in it.
+  wd is the inotify watch on the directory when running as a server (-1 otherwise).
+ */
+struct pathdir {
+  char *path ;
+  int fd ;
+  int wd ;
+  CMap *index ;
+  struct timespec mtime ;
+  bool dirty ;
+  bool unindexed ;
+};
+
+/*
+  The contents of the cache file (-c): a map from directory path to that directory's record (struct record).
+  A record is "<mtime sec> <mtime nsec> <count>\n" followed by count NUL terminated names.
+ */
+struct cache {
+  const char *file ;
+  char *data ;
+  size_t len ;
+  CMap *dirs ;
+};
+
+/*
+  A record of the cache file, read when the file is loaded: the mtime of the directory, the number of names and where
+  the names are in the data of the cache, from the offset names to the offset end.
+ */
+struct record {
+  long sec , nsec , count ;
+  size_t names , end ;
+};
+
+
+/*
+  The flags of mywhich: the file given with -c (NULL if there is none), whether -a asked for every match,
+  and the socket to serve lookups on (-s) or to send them to (-S), NULL if none.
+ */
+struct options {
+  const char *cacheFile ;
+  bool all ;
+  const char *serve ;
+  const char *connect ;
+};
+
+/*
+  A client of the server. in holds what it sent that was not looked up yet (inspace bytes allocated) and out the
+  answers queued for it, of which the first sent bytes were sent. started is set once its request header arrived,
+  all by its first byte, and done once it has sent all its names.
+ */
+struct client {
+  int fd ;
+  bool started ;
+  bool all ;
+  bool done ;
+  char *in ;
+  size_t inlen , inspace ;
+  char *out ;
+  size_t outlen , sent ;
+};
+
+static volatile sig_atomic_t stopping ; // set by SIGINT/SIGTERM to shut the server down
 
 
 /*
-  Tests if the file stored in find is executable. Returns true if yes and false otherwise.
+  Tests if the file named find in the directory dirfd is executable. Returns true if yes and false otherwise.
  */
-bool exists(char * find){ 
-  return access(find , X_OK)==0 ;
+bool exists(int dirfd, const char * find){
+  return dirfd >= 0 && faccessat(dirfd , find , X_OK , 0)==0 ;
 }
 
 /*
   Parses the arguments passed to mywhich. Returns a pointer to the PATH user varraible or
   a pointer to the delmited list of paths after the -p flag.
+  opts is an outparameter that stores the other flags.
   programIndex is an outparamter that stores the index in argv that the list of programs starts at.
  */
-char * parseArgs(char *argv[], char *envp[] , int *programIndex){
+char * parseArgs(char *argv[], char *envp[] , int *programIndex, struct options *opts){
   char *paths = NULL ;
-    if(strcmp(argv[1],"-p")!=0){
-    for(int i =0 ; envp[i]!=NULL ; i++){
-      if(strncmp(envp[i],"PATH=",5)==0){
-	paths = envp[i]+5 ;
-	*programIndex =1 ;
-	break ; // we found PATH, no need to 
-      }
+  int x = 1 ;
+  opts->cacheFile = NULL ;
+  opts->all = false ;
+  opts->serve = opts->connect = NULL ;
+
+  for(; argv[x] != NULL && argv[x][0] == '-' ; x++){
+    if(strcmp(argv[x],"-a")==0){
+      opts->all = true ;
+      continue ;
+    }
+    if(argv[x+1] == NULL) error(1,0,USAGE) ; // the other flags take a value
+    if(strcmp(argv[x],"-p")==0) paths = argv[++x] ;
+    else if(strcmp(argv[x],"-c")==0) opts->cacheFile = argv[++x] ;
+    else if(strcmp(argv[x],"-s")==0) opts->serve = argv[++x] ;
+    else if(strcmp(argv[x],"-S")==0) opts->connect = argv[++x] ;
+    else error(1,0,USAGE) ;
+  }
+  *programIndex = x ;
+
+  for(int i =0 ; paths == NULL && envp[i]!=NULL ; i++){
+    if(strncmp(envp[i],"PATH=",5)==0){
+      paths = envp[i]+5 ;
+      break ; // we found PATH, no need to
     }
-  }else{
-    paths = argv[2] ;
-    *programIndex = 3 ;
   }
   if(paths == NULL) error(1,0,"PATH not found") ; // for safety in case paths is stll null (ex. path varriable set to null string)
     return paths ;
 }
 
 /*
-  Takes in a file name (file) and a colon delimited list of paths (paths) and searches
-  all those paths in an attempt to find file in the paths (where file must be executable).
+  Takes in a colon delimited list of paths (paths) and splits it into an array of directories.
+  An empty entry is the current directory. ndirs is an outparameter holding the number of directories.
  */
-void findProgram(char * file , char*paths){
-  char * pathsAlter = paths , path[PATH_MAX] , *colonIndex=NULL ;
-  char * end = paths+strlen(paths) ;
-  
-  do { // loop through all paths
-    colonIndex = strchr(pathsAlter,':');
-    // if strcchr returns null, make colon index the last index of paths.
-    if(colonIndex==NULL) colonIndex = end;
-      
-    memset(path , '\0' , PATH_MAX*sizeof(char)) ; // set memory to 0 to be safe with str ops
-    memcpy(path , pathsAlter , (colonIndex-pathsAlter)*sizeof(char)); // copy the correct path to path
+struct pathdir *splitPaths(const char *paths, int *ndirs){
+  int n = 1 ;
+  for(const char *c = paths ; *c ; c++) if(*c == ':') n++ ;
 
-    sprintf(path+strlen(path) , "/%s",file) ; // add the file
+  struct pathdir *dirs = calloc(n , sizeof(struct pathdir)) ;
+  if(dirs == NULL) error(1,0,"Allocation failure") ;
 
-    if(exists(path)){
-      printf("%s\n",path);
-      break ; // only find the first
-    }
+  const char *start = paths ;
+  for(int x = 0 ; x < n ; x++){
+    const char *colonIndex = strchr(start , ':') ;
+    if(colonIndex == NULL) colonIndex = start+strlen(start) ; // the last path has no colon after it
+    dirs[x].path = (colonIndex == start) ? strdup(".") : strndup(start , colonIndex-start) ;
+    if(dirs[x].path == NULL) error(1,0,"Allocation failure") ;
+    dirs[x].fd = dirs[x].wd = -1 ;
+    start = colonIndex+1 ; // skip the ':'
+  }
+  *ndirs = n ;
+  return dirs ;
+}
+
+/*
+  Takes in the file given with -c (file) and reads it into cache, indexing the record of every directory in it.
+  A missing or unrecognized file leaves the cache empty, and only the records before a damaged or truncated one are kept.
+ */
+void loadCache(struct cache *cache, const char *file){
+  cache->file = file ;
+  cache->data = NULL ;
+  cache->len = 0 ;
+  cache->dirs = cmap_create(sizeof(struct record) , 0 , NULL) ;
+  if(file == NULL) return ;
+
+  int fd = open(file , O_RDONLY) ;
+  struct stat st ;
+  if(fd < 0) return ;
+  if(fstat(fd , &st) == 0 && (cache->data = malloc(st.st_size+1)) != NULL){
+    for(ssize_t n ; cache->len < (size_t)st.st_size && (n = read(fd , cache->data+cache->len , st.st_size-cache->len)) > 0 ;) cache->len += n ;
+    cache->data[cache->len] = '\0' ;
+  }
+  close(fd) ;
+  if(cache->data == NULL || cache->len < strlen(CACHE_MAGIC) || memcmp(cache->data , CACHE_MAGIC , strlen(CACHE_MAGIC)) != 0) return ;
+
+  // the file is a list of "<path>\0<record>" pairs after the magic line
+  char *end = cache->data+cache->len ;
+  for(char *cur = cache->data+strlen(CACHE_MAGIC) ; cur < end ;){
+    char *path = cur , *line = memchr(path , '\0' , end-path) ;
+    if(line == NULL) break ; // truncated file, keep what was read
+    line++ ;
+    char *nl = memchr(line , '\n' , end-line) ;
+    if(nl == NULL) break ;
+    *nl = '\0' ; // so the numbers are read from this line only
+    struct record rec ;
+    if(sscanf(line , "%ld %ld %ld" , &rec.sec , &rec.nsec , &rec.count) != 3 || rec.count < 0) break ;
+
+    char *name = nl+1 ;
+    long x = 0 ;
+    for(char *nul ; x < rec.count && (nul = memchr(name , '\0' , end-name)) != NULL ; x++) name = nul+1 ;
+    if(x < rec.count) break ; // some of the names are missing
+    rec.names = nl+1-cache->data ;
+    rec.end = name-cache->data ;
+    cmap_put(cache->dirs , path , &rec) ;
+    cur = name ;
+  }
+}
+
+/*
+  Takes in a directory of the PATH (dir) and builds its index, from the cache if its record has the directory's current
+  mtime and by reading the directory otherwise. A directory that cannot be read gets an empty index.
+  Relative directories depend on the current directory, so they are never cached.
+  Also opens the directory, which stays open for probing candidates with faccessat. A directory that cannot be read but
+  can be searched is opened with O_PATH, which faccessat accepts, and marked unindexed.
+ */
+void indexDir(struct pathdir *dir, struct cache *cache){
+  unsigned char type = DT_UNKNOWN ;
+  dir->index = cmap_create(sizeof(unsigned char) , 0 , NULL) ;
+
+  struct stat st ;
+  dir->unindexed = false ;
+  dir->fd = open(dir->path , O_RDONLY | O_DIRECTORY | O_CLOEXEC) ;
+  if(dir->fd < 0){
+    dir->fd = open(dir->path , O_PATH | O_DIRECTORY | O_CLOEXEC) ;
+    dir->unindexed = (dir->fd >= 0) ;
+    return ;
+  }
+  if(fstat(dir->fd , &st) != 0) return ;
+  dir->mtime = st.st_mtim ;
+
+  struct record *rec = (dir->path[0] == '/') ? cmap_get(cache->dirs , dir->path) : NULL ;
+  if(rec != NULL && rec->sec == st.st_mtim.tv_sec && rec->nsec == st.st_mtim.tv_nsec){
+    for(char *name = cache->data+rec->names , *end = cache->data+rec->end ; name < end ; name += strlen(name)+1) cmap_put(dir->index , name , &type) ;
+    return ; // the cached copy is current
+  }
+
+  int fd = dup(dir->fd) ; // closedir closes the descriptor it reads
+  DIR *dp = (fd < 0) ? NULL : fdopendir(fd) ;
+  if(dp == NULL){
+    if(fd >= 0) close(fd) ;
+    dir->unindexed = true ;
+    return ;
+  }
+  for(struct dirent *ent ; (ent = readdir(dp)) != NULL ;){
+    if(strcmp(ent->d_name , ".") == 0 || strcmp(ent->d_name , "..") == 0) continue ;
+    type = ent->d_type ;
+    cmap_put(dir->index , ent->d_name , &type) ;
+  }
+  closedir(dp) ;
+  dir->dirty = (dir->path[0] == '/') ;
+}
+
+/*
+  Writes the index of every directory that was read from disk to the cache file, keeping the records of the
+  other directories that were in it. Written to a temporary file that is renamed over the cache, so a reader never sees
+  a partial file.
+ */
+void saveCache(struct cache *cache, struct pathdir *dirs, int ndirs){
+  bool dirty = false ;
+  for(int x = 0 ; x < ndirs ; x++) dirty |= dirs[x].dirty ;
+  if(cache->file == NULL || !dirty) return ;
+
+  char tmp[PATH_MAX] ;
+  snprintf(tmp , sizeof(tmp) , "%s.%d" , cache->file , (int)getpid()) ;
+  FILE *fp = fopen(tmp , "w") ;
+  if(fp == NULL) return ; // the cache is optional
+
+  CMap *written = cmap_create(sizeof(bool) , 0 , NULL) ;
+  bool yes = true ;
+  fputs(CACHE_MAGIC , fp) ;
+  for(int x = 0 ; x < ndirs ; x++){
+    if(!dirs[x].dirty || cmap_get(written , dirs[x].path) != NULL) continue ;
+    fprintf(fp , "%s%c%ld %ld %d\n" , dirs[x].path , '\0' , (long)dirs[x].mtime.tv_sec , (long)dirs[x].mtime.tv_nsec , cmap_count(dirs[x].index)) ;
+    for(const char *name = cmap_first(dirs[x].index) ; name != NULL ; name = cmap_next(dirs[x].index , name)) fwrite(name , 1 , strlen(name)+1 , fp) ;
+    cmap_put(written , dirs[x].path , &yes) ;
+  }
 
-    pathsAlter = colonIndex+1 ; // skip the ':'
+  for(const char *path = cmap_first(cache->dirs) ; path != NULL ; path = cmap_next(cache->dirs , path)){
+    if(cmap_get(written , path) != NULL) continue ; // replaced by a fresh copy
+    const struct record *rec = cmap_get(cache->dirs , path) ;
+    fwrite(path , 1 , strlen(path)+1 , fp) ;
+    fprintf(fp , "%ld %ld %ld\n" , rec->sec , rec->nsec , rec->count) ;
+    fwrite(cache->data+rec->names , 1 , rec->end-rec->names , fp) ;
+  }
+  cmap_dispose(written) ;
+
+  if(fclose(fp) != 0 || rename(tmp , cache->file) != 0) unlink(tmp) ;
+}
 
-  }while(colonIndex!=end) ; // while colonIndex is not the last char in paths
-  //NOTE we set colonIndex to the last char in paths when there is no colon left.
+/*
+  Takes in a file name (file) and the directories of the PATH (dirs) and searches
+  all those directories in an attempt to find file in them (where file must be executable), printing the matches to out.
+  Each directory's index answers whether file is in it without touching the file system, so only a directory
+  that has an entry named file costs a syscall, a faccessat relative to the open directory that checks the entry is executable.
+  A file with a '/' in it (bin/tool) names something below a directory that the index does not list, so it is
+  always looked up with faccessat, and so is every file in a directory that could not be indexed.
+  Stops at the first match unless all is set (-a).
+ */
+void findProgram(FILE *out , const char * file , struct pathdir *dirs , int ndirs , struct cache *cache , bool all){
+  bool nested = strchr(file , '/') != NULL ;
+  for(int x = 0 ; x < ndirs ; x++){ // loop through all paths
+    if(dirs[x].index == NULL) indexDir(&dirs[x] , cache) ; // also opens the directory
+    if(!nested && !dirs[x].unindexed && cmap_get(dirs[x].index , file) == NULL) continue ;
+
+    if(exists(dirs[x].fd , file)){
+      fputs(dirs[x].path , out) ;
+      putc('/' , out) ;
+      fputs(file , out) ;
+      putc('\n' , out) ;
+      if(!all) break ; // only find the first
+    }
+  }
   return ;
 }
 
+/*
+  Looks up every complete line (a name) from cur to end, printing the matches to out.
+  Returns the start of the partial last line, end if there is none.
+ */
+char *findLines(char *cur , char *end , FILE *out , struct pathdir *dirs , int ndirs , struct cache *cache , bool all){
+  char *nl ;
+  while((nl = memchr(cur , '\n' , end-cur)) != NULL){
+    *nl = '\0' ;
+    if(nl > cur) findProgram(out , cur , dirs , ndirs , cache , all) ;
+    cur = nl+1 ;
+  }
+  return cur ;
+}
+
+/*
+  Batch mode: reads program names from in, one per line, and looks each one up as it arrives, printing to out.
+  Input is read in BATCH_READ sized chunks and the results of a chunk are flushed before waiting for the next one,
+  so a caller feeding names through a pipe gets its answers as a stream.
+  Returns false if reading in or writing out failed.
+ */
+bool findStream(int in , FILE *out , struct pathdir *dirs , int ndirs , struct cache *cache , bool all){
+  size_t space = BATCH_READ , used = 0 ;
+  char *buf = malloc(space+1) ;
+  bool ok = true ;
+  if(buf == NULL) error(1,0,"Allocation failure") ;
+
+  while(1){
+    if(space-used < BATCH_READ/2){ // a very long line, make room for the rest of it
+      space *= 2 ;
+      buf = realloc(buf , space+1) ;
+      if(buf == NULL) error(1,0,"Allocation failure") ;
+    }
+    ssize_t nread = read(in , buf+used , space-used) ;
+    if(nread < 0){
+      if(errno == EINTR && !stopping) continue ;
+      ok = false ;
+      break ;
+    }
+    used += nread ;
+    if(nread == 0 && used > 0 && buf[used-1] != '\n') buf[used++] = '\n' ; // the last name might not have a newline
+
+    char *end = buf+used , *cur = findLines(buf , end , out , dirs , ndirs , cache , all) ;
+    memmove(buf , cur , end-cur) ; // keep the partial last name for the next read
+    used = end-cur ;
+    if(fflush(out) != 0){ // the reader went away
+      ok = false ;
+      break ;
+    }
+    if(nread == 0) break ;
+  }
+  free(buf) ;
+  return ok ;
+}
+
+/*
+  Fills in addr with the Unix domain socket address of path. Returns its length, exits if path is too long.
+ */
+socklen_t socketAddr(struct sockaddr_un *addr , const char *path){
+  memset(addr , 0 , sizeof(*addr)) ;
+  addr->sun_family = AF_UNIX ;
+  if(strlen(path) >= sizeof(addr->sun_path)) error(1,0,"socket path too long: %s" , path) ;
+  strcpy(addr->sun_path , path) ;
+  return sizeof(*addr) ;
+}
+
+/*
+  Drops the index of dir, so the next lookup that reaches it opens, watches and reads the directory again.
+ */
+void forgetDir(struct pathdir *dir , int inotifyFd){
+  if(dir->wd >= 0) inotify_rm_watch(inotifyFd , dir->wd) ;
+  if(dir->fd >= 0) close(dir->fd) ;
+  if(dir->index != NULL) cmap_dispose(dir->index) ;
+  dir->index = NULL ;
+  dir->fd = dir->wd = -1 ;
+}
+
+/*
+  Makes sure every directory of the PATH is watched and indexed. The watch is added before the directory is read,
+  so an entry created while it is read shows up as an event and is not lost. Directories that could not be
+  opened are retried, they may have been created since. A removed directory is noticed by its link count, since the
+  open descriptor keeps it alive and IN_DELETE_SELF only comes once the last reference is gone.
+ */
+void watchDirs(struct pathdir *dirs , int ndirs , struct cache *cache , int inotifyFd){
+  struct stat st ;
+  for(int x = 0 ; x < ndirs ; x++){
+    if(dirs[x].index != NULL && dirs[x].fd >= 0 && fstat(dirs[x].fd , &st) == 0 && st.st_nlink > 0) continue ;
+    forgetDir(&dirs[x] , inotifyFd) ;
+    dirs[x].wd = inotify_add_watch(inotifyFd , dirs[x].path , WATCH_EVENTS) ;
+    indexDir(&dirs[x] , cache) ;
+  }
+}
+
+/*
+  Applies the pending inotify events to the indexes without blocking: a created or moved in entry is added to the index
+  of its directory and a deleted or moved out entry is removed, so only the names that changed are touched.
+  A directory that was itself deleted or moved is forgotten, and if the kernel dropped events every directory is.
+  Permission changes need no event, a match is always checked with faccessat.
+ */
+void applyEvents(struct pathdir *dirs , int ndirs , int inotifyFd){
+  char buf[64*1024] __attribute__((aligned(__alignof__(struct inotify_event)))) ;
+  unsigned char type = DT_UNKNOWN ;
+  ssize_t n ;
+  while((n = read(inotifyFd , buf , sizeof(buf))) > 0){
+    for(char *cur = buf ; cur < buf+n ; cur += sizeof(struct inotify_event)+((struct inotify_event*)cur)->len){
+      struct inotify_event *ev = (struct inotify_event*)cur ;
+      if(ev->mask & IN_Q_OVERFLOW){
+        for(int x = 0 ; x < ndirs ; x++) forgetDir(&dirs[x] , inotifyFd) ;
+        continue ;
+      }
+      for(int x = 0 ; x < ndirs ; x++){ // the same directory can be in the PATH more than once
+        if(dirs[x].wd != ev->wd || dirs[x].index == NULL) continue ;
+        if(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) forgetDir(&dirs[x] , inotifyFd) ;
+        else if(ev->len == 0) continue ;
+        else if(ev->mask & (IN_CREATE | IN_MOVED_TO)) cmap_put(dirs[x].index , ev->name , &type) ;
+        else if(ev->mask & (IN_DELETE | IN_MOVED_FROM)) cmap_remove(dirs[x].index , ev->name) ;
+      }
+    }
+  }
+}
+
+/*
+  Adds the len bytes at answers to the queue of the client c.
+ */
+void queueAnswers(struct client *c , const char *answers , size_t len){
+  memmove(c->out , c->out+c->sent , c->outlen-c->sent) ; // drop what was sent before adding to the queue
+  c->outlen -= c->sent ;
+  c->sent = 0 ;
+  c->out = realloc(c->out , c->outlen+len+1) ;
+  if(c->out == NULL) error(1,0,"Allocation failure") ;
+  memcpy(c->out+c->outlen , answers , len) ;
+  c->outlen += len ;
+}
+
+/*
+  Reads what the client c sent, without blocking, and looks up the names it completes, queuing the answers in c->out.
+  A client sends a request byte (REQ_FIRST or REQ_ALL), then its PATH and its current directory each followed by a NUL,
+  then names one per line. The server only answers for its own PATH (paths), and if that has relative directories
+  only in its own current directory (cwd, NULL if there are none): it replies REPLY_OK followed by the same output as
+  the command line, or just REPLY_OTHER. Returns false if the client is gone or sent a bad request.
+ */
+bool readClient(struct client *c , const char *paths , const char *cwd , struct pathdir *dirs , int ndirs , struct cache *cache){
+  if(c->inspace-c->inlen < BATCH_READ/2){
+    c->inspace = (c->inspace == 0) ? BATCH_READ : 2*c->inspace ;
+    c->in = realloc(c->in , c->inspace+1) ;
+    if(c->in == NULL) error(1,0,"Allocation failure") ;
+  }
+  ssize_t nread = read(c->fd , c->in+c->inlen , c->inspace-c->inlen) ;
+  if(nread < 0) return errno == EAGAIN || errno == EINTR ;
+  c->inlen += nread ;
+  if(nread == 0){
+    c->done = true ;
+    if(c->inlen > 0 && c->in[c->inlen-1] != '\n') c->in[c->inlen++] = '\n' ; // the last name might not have a newline
+  }
+
+  char *cur = c->in , *end = c->in+c->inlen ;
+  if(!c->started){
+    if(cur == end) return true ;
+    if(*cur != REQ_FIRST && *cur != REQ_ALL) return false ;
+    char *pathEnd = memchr(cur , '\0' , end-cur) ;
+    char *cwdEnd = (pathEnd == NULL) ? NULL : memchr(pathEnd+1 , '\0' , end-pathEnd-1) ;
+    if(cwdEnd == NULL) return !c->done && c->inlen < BATCH_READ ; // the header is not all here yet
+    c->all = (*cur == REQ_ALL) ;
+    char reply = (strcmp(cur+1 , paths) == 0 && (cwd == NULL || strcmp(pathEnd+1 , cwd) == 0)) ? REPLY_OK : REPLY_OTHER ;
+    queueAnswers(c , &reply , 1) ;
+    if(reply == REPLY_OTHER){
+      c->done = true ; // the rest of the request is not for this server
+      c->inlen = 0 ;
+      return true ;
+    }
+    c->started = true ;
+    cur = cwdEnd+1 ;
+  }
+
+  char *answers ;
+  size_t size ;
+  FILE *out = open_memstream(&answers , &size) ;
+  if(out == NULL) error(1,0,"Allocation failure") ;
+  cur = findLines(cur , end , out , dirs , ndirs , cache , c->all) ;
+  fclose(out) ;
+  queueAnswers(c , answers , size) ;
+  free(answers) ;
+
+  memmove(c->in , cur , end-cur) ; // keep the partial last name for the next read
+  c->inlen = end-cur ;
+  return true ;
+}
+
+/*
+  Sends the client c as much of its queued answers as it takes without blocking. Returns false if the client is gone.
+ */
+bool writeClient(struct client *c){
+  while(c->sent < c->outlen){
+    ssize_t n = send(c->fd , c->out+c->sent , c->outlen-c->sent , MSG_NOSIGNAL) ;
+    if(n < 0) return errno == EAGAIN || errno == EINTR ;
+    c->sent += n ;
+  }
+  return true ;
+}
+
+void dropClient(struct client *c){
+  close(c->fd) ;
+  free(c->in) ;
+  free(c->out) ;
+  c->fd = -1 ;
+}
+
+static void onSignal(int sig){
+  (void)sig ;
+  stopping = 1 ;
+}
+
+/*
+  Server mode (-s): keeps the PATH and the index of each of its directories in memory and answers lookups on the Unix domain
+  socket path, for clients with the same PATH (paths). Clients are served together from one poll loop, each as its names arrive, and stay connected for as
+  long as they like. A client that has BATCH_READ bytes of answers it has not read yet is not read from until it
+  reads them. inotify keeps the indexes current and pending events are applied before each round of lookups.
+  Runs until SIGINT or SIGTERM, then removes the socket and writes the cache file (-c) if there is one.
+ */
+void serve(const char *path , const char *paths , struct pathdir *dirs , int ndirs , struct cache *cache){
+  int inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC) ;
+  if(inotifyFd < 0) error(1,errno,"inotify_init1") ;
+
+  struct sockaddr_un addr ;
+  socklen_t addrlen = socketAddr(&addr , path) ;
+  int sock = socket(AF_UNIX , SOCK_STREAM | SOCK_CLOEXEC , 0) ;
+  if(sock < 0) error(1,errno,"socket") ;
+  struct stat st ;
+  if(lstat(path , &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path) ; // left behind by a server that did not exit cleanly
+  if(bind(sock , (struct sockaddr*)&addr , addrlen) != 0) error(1,errno,"%s" , path) ;
+  if(listen(sock , SOMAXCONN) != 0) error(1,errno,"listen") ;
+
+  struct sigaction sa = { .sa_handler = onSignal } ; // no SA_RESTART, so poll returns on a signal
+  sigaction(SIGINT , &sa , NULL) ;
+  sigaction(SIGTERM , &sa , NULL) ;
+  signal(SIGPIPE , SIG_IGN) ; // a client that hangs up early must not kill the server
+
+  char *cwd = NULL ; // only needed to match clients if the PATH has relative directories
+  for(int x = 0 ; x < ndirs && cwd == NULL ; x++){
+    if(dirs[x].path[0] != '/' && (cwd = getcwd(NULL , 0)) == NULL) error(1,errno,"getcwd") ;
+  }
+
+  watchDirs(dirs , ndirs , cache , inotifyFd) ;
+  struct client *clients = NULL ;
+  struct pollfd *fds = NULL ;
+  int nclients = 0 ;
+  while(!stopping){
+    fds = realloc(fds , (nclients+2)*sizeof(struct pollfd)) ;
+    if(fds == NULL) error(1,0,"Allocation failure") ;
+    fds[0] = (struct pollfd){ .fd = sock , .events = POLLIN } ;
+    fds[1] = (struct pollfd){ .fd = inotifyFd , .events = POLLIN } ;
+    for(int x = 0 ; x < nclients ; x++){
+      struct client *c = &clients[x] ;
+      bool reading = !c->done && c->outlen-c->sent < BATCH_READ ;
+      fds[x+2] = (struct pollfd){ .fd = c->fd , .events = (reading ? POLLIN : 0) | ((c->sent < c->outlen) ? POLLOUT : 0) } ;
+    }
+    if(poll(fds , nclients+2 , -1) < 0){
+      if(errno == EINTR) continue ;
+      error(1,errno,"poll") ;
+    }
+    applyEvents(dirs , ndirs , inotifyFd) ;
+
+    bool watched = false ;
+    for(int x = 0 ; x < nclients ; x++){
+      struct client *c = &clients[x] ;
+      bool ok = true ;
+      if((fds[x+2].events & POLLIN) && (fds[x+2].revents & (POLLIN | POLLHUP | POLLERR))){
+        if(!watched) watchDirs(dirs , ndirs , cache , inotifyFd) ;
+        watched = true ;
+        ok = readClient(c , paths , cwd , dirs , ndirs , cache) ;
+      }
+      if(ok && fds[x+2].revents) ok = writeClient(c) ;
+      if(!ok || (c->done && c->sent == c->outlen)) dropClient(c) ;
+    }
+    int kept = 0 ;
+    for(int x = 0 ; x < nclients ; x++) if(clients[x].fd >= 0) clients[kept++] = clients[x] ;
+    nclients = kept ;
+
+    if(!(fds[0].revents & POLLIN)) continue ;
+    int client = accept4(sock , NULL , NULL , SOCK_CLOEXEC | SOCK_NONBLOCK) ;
+    if(client < 0) continue ;
+    clients = realloc(clients , (nclients+1)*sizeof(struct client)) ;
+    if(clients == NULL) error(1,0,"Allocation failure") ;
+    clients[nclients++] = (struct client){ .fd = client } ;
+  }
+  for(int x = 0 ; x < nclients ; x++) dropClient(&clients[x]) ;
+  free(clients) ;
+  free(fds) ;
+  free(cwd) ;
+  close(sock) ;
+  unlink(path) ;
+  close(inotifyFd) ;
+}
+
+/*
+  Client mode (-S): sends the names (names, or stdin if there are none) to the server on the socket path and copies its
+  answers to stdout, so the output is the same as a lookup done here. The request carries the PATH to search (paths) and
+  the current directory, since the server only answers for its own. Returns false if the server cannot be reached or
+  searches another PATH, so the caller can fall back to looking the names up itself. Nothing is read from stdin before the
+  server accepted the request.
+ */
+bool askServer(const char *path , const char *paths , char **names , int nnames , bool all){
+  struct sockaddr_un addr ;
+  socklen_t addrlen = socketAddr(&addr , path) ;
+  int sock = socket(AF_UNIX , SOCK_STREAM | SOCK_CLOEXEC , 0) ;
+  if(sock < 0) return false ;
+  if(connect(sock , (struct sockaddr*)&addr , addrlen) != 0){
+    close(sock) ;
+    return false ;
+  }
+  char *req ;
+  size_t reqlen ;
+  FILE *fp = open_memstream(&req , &reqlen) ;
+  if(fp == NULL) error(1,0,"Allocation failure") ;
+  char *cwd = getcwd(NULL , 0) ;
+  putc(all ? REQ_ALL : REQ_FIRST , fp) ;
+  fprintf(fp , "%s%c%s%c" , paths , '\0' , (cwd == NULL) ? "" : cwd , '\0') ;
+  free(cwd) ;
+  for(int x = 0 ; x < nnames ; x++) fprintf(fp , "%s\n" , names[x]) ;
+  fclose(fp) ;
+
+  // stream the names (the request, then stdin) to the server while copying the answers back, only sending what the socket
+  // takes without blocking, so the answers are always read and the server never waits on a client that waits on it
+  char in[BATCH_READ] , buf[BATCH_READ] ;
+  const char *data = req ;
+  size_t len = reqlen , sent = 0 ;
+  bool more = (nnames == 0) , closed = false , accepted = false ; // more names to come from stdin, the names were all sent
+  while(1){
+    if(!closed && sent == len && !more){
+      shutdown(sock , SHUT_WR) ;
+      closed = true ;
+    }
+    struct pollfd fds[2] = { { .fd = sock , .events = POLLIN | ((sent < len) ? POLLOUT : 0) } ,
+                             { .fd = (accepted && more && sent == len) ? STDIN_FILENO : -1 , .events = POLLIN } } ;
+    if(poll(fds , 2 , -1) < 0){
+      if(errno == EINTR) continue ;
+      error(1,errno,"poll") ;
+    }
+    if(fds[0].revents & POLLOUT){
+      ssize_t n = send(sock , data+sent , len-sent , MSG_DONTWAIT | MSG_NOSIGNAL) ;
+      if(n >= 0) sent += n ;
+      else if(errno != EAGAIN && errno != EINTR) sent = len , more = false ; // the server went away, read what it answered
+    }
+    if(fds[1].revents){
+      ssize_t n = read(STDIN_FILENO , in , sizeof(in)) ;
+      if(n > 0){
+        data = in ;
+        len = n ;
+        sent = 0 ;
+      }
+      else if(n == 0 || errno != EINTR) more = false ; // end of the names
+    }
+    if(fds[0].revents & (POLLIN | POLLHUP | POLLERR)){
+      ssize_t n = read(sock , buf , sizeof(buf)) ;
+      if(!accepted && (n <= 0 || buf[0] != REPLY_OK)){ // not this server's PATH, or it went away before it answered
+        free(req) ;
+        close(sock) ;
+        return false ;
+      }
+      if(n <= 0) break ; // the server answered everything
+      size_t skip = accepted ? 0 : 1 ; // the reply byte
+      accepted = true ;
+      fwrite(buf+skip , 1 , n-skip , stdout) ;
+      fflush(stdout) ;
+    }
+  }
+  free(req) ;
+  close(sock) ;
+  return true ;
+}
+
 /*
   Implementation of which. Takes in its arguments and environment varraiables and
   determines the paths to search for a given file. Then searches each of those paths for each
-  file passed to mywhich.
+  file passed to mywhich, or for each name read from stdin if there are none.
+  -c CACHEFILE keeps the directory indexes in CACHEFILE between runs.
+  -a prints every match instead of only the first one.
+  -s SOCKET runs a resident server answering lookups on SOCKET, and -S SOCKET sends the lookups to that server
+  with the same PATH, looking them up here if no server is listening or it searches another PATH (or the same relative
+  directories from another current directory).
  */
 int main(int argc, char *argv[], char *envp[])
 {
-  int programIndex ;
-  char *paths = parseArgs(argv , envp , &programIndex) ;
+  int programIndex , ndirs ;
+  struct options opts ;
+  char *paths = parseArgs(argv , envp , &programIndex , &opts) ;
+  if(opts.serve != NULL && opts.connect != NULL) error(1,0,USAGE) ;
+  if(opts.connect != NULL && askServer(opts.connect , paths , argv+programIndex , argc-programIndex , opts.all)) return 0 ;
+  struct pathdir *dirs = splitPaths(paths , &ndirs) ;
+
+  struct cache cache ;
+  loadCache(&cache , opts.cacheFile) ;
 
-  for(int x = programIndex ; x < argc ; x++) findProgram(argv[x] , paths) ;
-   
+  if(opts.serve != NULL) serve(opts.serve , paths , dirs , ndirs , &cache) ;
+  else if(programIndex == argc) findStream(STDIN_FILENO , stdout , dirs , ndirs , &cache , opts.all) ;
+  for(int x = programIndex ; x < argc && opts.serve == NULL ; x++) findProgram(stdout , argv[x] , dirs , ndirs , &cache , opts.all) ;
+
+  saveCache(&cache , dirs , ndirs) ;
   return 0;
 }
-
@@ -5,20 +5,30 @@
 #include <assert.h>
 #include <string.h>
 #include <search.h> 
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+#include "cvector.h"
 
-#define DEFAULT_CAPACITY 16
+#define DEFAULT_CAPACITY CVEC_DEFAULT_CAPACITY
+#define DEFAULT_GROWTH CVEC_DEFAULT_GROWTH
+#define PARALLEL_SORT_MIN 65536 // below this many elements cvec_sort_parallel just calls qsort
+#define MAX_SORT_THREADS 64
+#define INDEX_BATCH 16 // searches cvec_index_search_n runs side by side
+#define PARALLEL_CHUNK (256*1024) // bytes of elements per chunk of cvec_parallel_for and cvec_reduce
 
 
-typedef void (*CleanupElemFn)(void *addr) ;
-
 struct vec {
   char * elements ;  // byte array to hold the vector
   size_t nelems , elemsz , space; // various size paramters to make the pointer arithmatic possible
+  double growth ; // factor the space is multiplied by when the vector is full
   CleanupElemFn cleanup ; // custom cleanup function in case the values in the vector are not standard non pointer types (ie int)
+  CAllocator alloc ; // where the vector and its elements come from
 };
 
-typedef struct vec CVector ;
-
 
 /*
   Takes as input a size_t representing the size of the elements that will be in the vector,
@@ -27,19 +37,32 @@ typedef struct vec CVector ;
   Returns a pointer to the created CVector.
  */
 CVector *cvec_create(size_t elemsz, size_t capacity_hint, CleanupElemFn fn)
+{
+  return cvec_create_with(elemsz , capacity_hint , fn , &callocator_heap) ;
+}
+
+/*
+  Same as cvec_create, except that the vector and its elements come from the allocator (alloc), which is copied.
+  With an arena the vector can be dropped at once by resetting the arena instead of calling cvec_dispose.
+  The scratch buffers of the sorts and search indexes still come from malloc.
+ */
+CVector *cvec_create_with(size_t elemsz, size_t capacity_hint, CleanupElemFn fn, const CAllocator *alloc)
 {
   if(elemsz ==0) assert("Allocation Failure") ;
   if(capacity_hint ==0) capacity_hint = DEFAULT_CAPACITY ;
 
-  CVector *vec = calloc(sizeof(CVector), 1);
+  CVector *vec = alloc->alloc(alloc->ctx , sizeof(CVector));
   if(vec == NULL) assert("Allocation failure") ;
+  memset(vec , 0 , sizeof(CVector)) ;
+  vec->alloc = *alloc ;
 
-  vec->elements = malloc(elemsz*capacity_hint) ;
+  vec->elements = alloc->alloc(alloc->ctx , elemsz*capacity_hint) ;
   if(vec->elements==NULL) assert("Allocation failure") ;
   vec->nelems = 0 ;
   vec->elemsz = elemsz ;
   vec->cleanup = fn ;
   vec->space = capacity_hint ;
+  vec->growth = DEFAULT_GROWTH ;
 
   return vec ;
 }
@@ -54,8 +77,9 @@ void cvec_dispose(CVector *cv){
       cv->cleanup(cv->elements+cv->elemsz*x) ;
     }
   }
-  free(cv->elements) ;
-  free(cv) ;
+  CAllocator alloc = cv->alloc ;
+  alloc.free(alloc.ctx , cv->elements , cv->space*cv->elemsz) ;
+  alloc.free(alloc.ctx , cv , sizeof(CVector)) ;
 }
 
 /*
@@ -65,6 +89,13 @@ int cvec_count(const CVector *cv){
   return (int)cv->nelems ;
 }
 
+/*
+  Takes as input a CVector (cv) and returns the number of elements it has room for before it has to grow.
+ */
+size_t cvec_capacity(const CVector *cv){
+  return cv->space ;
+}
+
 /*
   Tkaes as input a CVector (cv) and an index (index) and returns a pointer to the value at that index.
   Asserts if the index is out of bounds.
@@ -75,24 +106,63 @@ void *cvec_nth(const CVector *cv, int index){
 }
 
 /*
-  Takes as input a CVector (cv) by reference and grows it by a factor of 2. to allow foor more elements to be added.
+  Takes as input a CVector (cv) and the number of elements it must have room for (needed) and grows it with a
+  single realloc, by its growth factor or to exactly needed if that is not enough.
  */
-void grow(CVector ** cv){
-  char * temp = realloc((*cv)->elements , (*cv)->space*(*cv)->elemsz*2) ; // attempt to double the size in place
+static void grow(CVector * cv , size_t needed){
+  if(needed <= cv->space) return ;
+  size_t space = (size_t)(cv->space*cv->growth) ;
+  if(space <= cv->space) space = cv->space+1 ; // a growth factor close to 1 on a small vector
+  if(space < needed) space = needed ;
+  char * temp = cv->alloc.realloc(cv->alloc.ctx , cv->elements , cv->space*cv->elemsz , space*cv->elemsz) ; // attempt to grow in place
   if(temp == NULL) assert("Allocation failure") ; // catch any allocation failure.
-  (*cv)->elements = temp ;
-  (*cv)->space*=2 ;
+  cv->elements = temp ;
+  cv->space = space ;
+}
+
+/*
+  Takes as input a CVector (cv) and a number of elements (n) and makes room for at least n elements,
+  so that n appends reallocate at most once.
+ */
+void cvec_reserve(CVector *cv, size_t n){
+  if(n <= cv->space) return ;
+  char * temp = cv->alloc.realloc(cv->alloc.ctx , cv->elements , cv->space*cv->elemsz , n*cv->elemsz) ;
+  if(temp == NULL) assert("Allocation failure") ;
+  cv->elements = temp ;
+  cv->space = n ;
+}
+
+/*
+  Takes as input a CVector (cv) and sets the factor its space is multiplied by when it is full (2 by default).
+  A smaller factor such as 1.5 wastes less memory on large vectors at the cost of more reallocations.
+  Asserts if the factor is not greater than 1.
+ */
+void cvec_set_growth(CVector *cv, double factor){
+  if(!(factor > 1)) assert("Invalid growth factor") ;
+  cv->growth = factor ;
+}
+
+/*
+  Takes as input a CVector (cv) and gives back the space allocated past its last element.
+ */
+void cvec_shrink_to_fit(CVector *cv){
+  size_t space = (cv->nelems == 0) ? 1 : cv->nelems ; // keep a valid allocation
+  if(space == cv->space) return ;
+  char * temp = cv->alloc.realloc(cv->alloc.ctx , cv->elements , cv->space*cv->elemsz , space*cv->elemsz) ;
+  if(temp == NULL) return ; // the old block is still valid
+  cv->elements = temp ;
+  cv->space = space ;
 }
 
 /*
   Takes as input a CVector (cv), a void* which is a pointer to element to be added, and an index of where to add that element
   in the vector. leverages the memmove function to efficiently move the tail end of the vector over one element.
-  Grows the vector by a factor of 2 if necessary.
+  Grows the vector by its growth factor if necessary.
   Asserts if the index is out of bounds.
  */
 void cvec_insert(CVector *cv, const void *addr, int index){
   if(index < 0 || index > cv->nelems) assert("Invalid index") ;
-  if(cv->space == cv->nelems)   grow(&cv) ;
+  if(cv->space == cv->nelems)   grow(cv , cv->nelems+1) ;
 
   memmove(cv->elements+(index+1)*cv->elemsz , cv->elements+(index)*cv->elemsz , cv->elemsz*(cv->nelems-index)) ;
 
@@ -105,15 +175,40 @@ void cvec_insert(CVector *cv, const void *addr, int index){
   Takes as input a CVector (cv) and an element to add the vector (addr) and adds the element at the end of the vector
   Grows the size of the vector if necessary.
   If there is empty allocated space at the end of the vector, we still have room.
-  NOTE that this implementation does not shrink the allocated size ever.
+  NOTE that the allocated size is only ever shrunk by cvec_shrink_to_fit.
  */
 void cvec_append(CVector *cv, const void *addr){
-  if(cv->space == cv->nelems)  grow(&cv) ;
+  if(cv->space == cv->nelems)  grow(cv , cv->nelems+1) ;
 
   memcpy(cv->elements+(cv->nelems)*cv->elemsz , addr , cv->elemsz) ;
   cv->nelems++ ;
 }
 
+/*
+  Takes as input a CVector (cv), an array of n elements (addr) and adds them at the end of the vector
+  with at most one reallocation and a single copy.
+ */
+void cvec_append_n(CVector *cv, const void *addr, size_t n){
+  grow(cv , cv->nelems+n) ;
+  memcpy(cv->elements+cv->nelems*cv->elemsz , addr , n*cv->elemsz) ;
+  cv->nelems += n ;
+}
+
+/*
+  Takes as input a CVector (cv), an array of n elements (addr) and an index, and inserts the elements in order at index.
+  The tail of the vector is moved once, so inserting n elements costs as much as inserting one.
+  Asserts if the index is out of bounds.
+ */
+void cvec_insert_range(CVector *cv, const void *addr, size_t n, int index){
+  if(index < 0 || index > cv->nelems) assert("Invalid index") ;
+  grow(cv , cv->nelems+n) ;
+
+  memmove(cv->elements+(index+n)*cv->elemsz , cv->elements+index*cv->elemsz , cv->elemsz*(cv->nelems-index)) ;
+  memcpy(cv->elements+index*cv->elemsz , addr , n*cv->elemsz) ;
+
+  cv->nelems += n ;
+}
+
 /*
   Takes as input a CVector (cv), the address of an element to be put into the vector, 
   and the index of the element to replace.
@@ -140,22 +235,180 @@ void cvec_remove(CVector *cv, int index){
 }
 
 /*
-  Takes as input a CVector (cv), a string (key), a comperator function (cmp), a start index (start), and boolean (sorted) if the vector is sorted
-  Returns the index of the found element or -1 if the element was not found or was below the start index.
+  Takes as input a CVector (cv), an index (index) and a number of elements (n) and removes the n elements starting at index,
+  calling the cleanup function on each and moving the tail down once.
+  Asserts if the range is out of bounds.
+ */
+void cvec_remove_range(CVector *cv, int index, size_t n){
+  if(index < 0 || index+n > cv->nelems) assert("Invalid range") ;
+  if(cv->cleanup != NULL){
+    for(size_t x = 0 ; x < n ; x++) cv->cleanup(cv->elements+(index+x)*cv->elemsz) ;
+  }
+  memmove(cv->elements+cv->elemsz*index , cv->elements+cv->elemsz*(index+n) , cv->elemsz*(cv->nelems-index-n)) ;
+
+  cv->nelems -= n ;
+}
+
+/*
+  Takes as input the elements (base, n of them of elemsz bytes) and an element (key), and returns the index of the first
+  element with the same bytes as key or -1. Elements of 1, 2, 4 or 8 bytes are compared 16 bytes at a time with SSE2,
+  with a compare of the element's width so the mask only has bits set for whole matches.
+ */
+static long scan_bytes(const char *base , size_t n , size_t elemsz , const void *key){
+  size_t x = 0 ;
+#ifdef __SSE2__
+  if(elemsz == 1 || elemsz == 2 || elemsz == 4 || elemsz == 8){
+    char pattern[16] ;
+    for(size_t b = 0 ; b < 16 ; b += elemsz) memcpy(pattern+b , key , elemsz) ;
+    __m128i needle = _mm_loadu_si128((const __m128i*)pattern) ;
+    size_t perVector = 16/elemsz ;
+    for(; x+perVector <= n ; x += perVector){
+      __m128i v = _mm_loadu_si128((const __m128i*)(base+x*elemsz)) , eq ;
+      if(elemsz == 1) eq = _mm_cmpeq_epi8(v , needle) ;
+      else if(elemsz == 2) eq = _mm_cmpeq_epi16(v , needle) ;
+      else{
+        eq = _mm_cmpeq_epi32(v , needle) ;
+        if(elemsz == 8) eq = _mm_and_si128(eq , _mm_shuffle_epi32(eq , _MM_SHUFFLE(2,3,0,1))) ; // both halves equal
+      }
+      unsigned mask = _mm_movemask_epi8(eq) ;
+      if(mask != 0) return (long)(x+__builtin_ctz(mask)/elemsz) ;
+    }
+  }
+#endif
+  for(; x < n ; x++) if(memcmp(base+x*elemsz , key , elemsz) == 0) return (long)x ;
+  return -1 ;
+}
+
+/*
+  Takes as input a CVector (cv), the address of an element to look for (key), a comperator function (cmp), a start index (start),
+  and boolean (sorted) if the vector is sorted.
+  Returns the index of the first matching element at or after start, or -1 if there is none.
+  The sorted search is a binary search for the first of the matching elements in [start, count).
+  The unsorted search calls cmp on each element, or if cmp is NULL compares the bytes of the elements with key,
+  which for elements of 1, 2, 4 or 8 bytes is done with SIMD.
  */
 int cvec_search(const CVector *cv, const void *key, CompareFn cmp, int start, bool sorted){
-  if(start < 0 || start > cv->nelems-1) assert("Invalid start index") ;
-  char * location = NULL ;
-  size_t a = cv->nelems ;
-  if(sorted){ // do binary search
-    location = (char*)bsearch(key , cv->elements ,  cv->nelems , cv->elemsz , cmp) ;
-  }else{ // linear search.
-    location = (char*)lfind(key , cv->elements , &(a) , cv->elemsz , cmp) ;
-  }
-  if(location == NULL || (location-cv->elements)/cv->elemsz < start) return -1 ; // -1 if the element didn't exist or was below the start index.
+  if(start < 0 || start > cv->nelems) assert("Invalid start index") ;
+  if(sorted){ // binary search for the lower bound
+    if(cmp == NULL) assert("Sorted search without a comparator") ;
+    size_t lo = start , hi = cv->nelems ;
+    while(lo < hi){
+      size_t mid = lo+(hi-lo)/2 ;
+      if(cmp(cv->elements+mid*cv->elemsz , key) < 0) lo = mid+1 ;
+      else hi = mid ;
+    }
+    return (lo < cv->nelems && cmp(cv->elements+lo*cv->elemsz , key) == 0) ? (int)lo : -1 ;
+  }
+
+  size_t a = cv->nelems-start ;
+  if(cmp == NULL){
+    long found = scan_bytes(cv->elements+start*cv->elemsz , a , cv->elemsz , key) ;
+    return (found < 0) ? -1 : (int)found+start ;
+  }
+  char * location = (char*)lfind(key , cv->elements+start*cv->elemsz , &(a) , cv->elemsz , cmp) ;
+  if(location == NULL) return -1 ; // -1 if the element didn't exist at or after the start index.
   return (location-cv->elements)/cv->elemsz ;  // the index
 }
 
+/*
+  A read-only search index over a sorted CVector: a copy of its elements in Eytzinger (breadth first binary tree) order,
+  so the first levels of every search share the same few cache lines and the next levels can be prefetched,
+  and the original index of each of them. Slot 0 is unused, the children of slot k are 2k and 2k+1.
+ */
+struct vecindex {
+  char *elements ;
+  int *indices ;
+  size_t nelems , elemsz ;
+  CompareFn cmp ;
+};
+
+/*
+  Fills the slots of the tree rooted at k with the sorted elements from *next on, in order.
+ */
+static void eytzinger_fill(CVecIndex *ix , const CVector *cv , size_t *next , size_t k){
+  if(k > ix->nelems) return ;
+  eytzinger_fill(ix , cv , next , 2*k) ;
+  memcpy(ix->elements+k*ix->elemsz , cv->elements+(*next)*cv->elemsz , ix->elemsz) ;
+  ix->indices[k] = (int)(*next)++ ;
+  eytzinger_fill(ix , cv , next , 2*k+1) ;
+}
+
+/*
+  Takes as input a CVector (cv) sorted by cmp and builds a search index over it. The index is a copy,
+  so it stays valid when cv is changed or disposed but stops describing it.
+ */
+CVecIndex *cvec_index_create(const CVector *cv, CompareFn cmp){
+  CVecIndex *ix = calloc(sizeof(CVecIndex) , 1) ;
+  if(ix == NULL) assert("Allocation failure") ;
+  ix->nelems = cv->nelems ;
+  ix->elemsz = cv->elemsz ;
+  ix->cmp = cmp ;
+  void *elements = NULL ; // cache line aligned, so the 16 children prefetched together share as few lines as possible
+  if(posix_memalign(&elements , 64 , (ix->nelems+1)*ix->elemsz) != 0) elements = NULL ;
+  ix->elements = elements ;
+  ix->indices = malloc((ix->nelems+1)*sizeof(int)) ;
+  if(ix->elements == NULL || ix->indices == NULL) assert("Allocation failure") ;
+  size_t next = 0 ;
+  eytzinger_fill(ix , cv , &next , 1) ;
+  return ix ;
+}
+
+/*
+  Takes as input a CVecIndex (ix) and frees it.
+ */
+void cvec_index_dispose(CVecIndex *ix){
+  free(ix->elements) ;
+  free(ix->indices) ;
+  free(ix) ;
+}
+
+/*
+  Takes the slot a search ended at (k, one past a leaf) and returns the index in the vector of the first element
+  not less than key if it is equal to key, -1 otherwise.
+ */
+static int index_result(const CVecIndex *ix , size_t k , const void *key){
+  k >>= __builtin_ffsl(~k) ; // undo the right turns taken after the last left one
+  if(k == 0 || ix->cmp(ix->elements+k*ix->elemsz , key) != 0) return -1 ;
+  return ix->indices[k] ;
+}
+
+/*
+  Takes as input a CVecIndex (ix) and the address of an element (key) and returns the index in the vector of the first
+  element equal to key, or -1 if there is none, like cvec_search on the sorted vector.
+  Prefetches the 16 descendants four levels down on every step, which are contiguous in the Eytzinger layout.
+ */
+int cvec_index_search(const CVecIndex *ix, const void *key){
+  size_t k = 1 ;
+  while(k <= ix->nelems){
+    __builtin_prefetch(ix->elements+16*k*ix->elemsz) ;
+    k = 2*k+(ix->cmp(ix->elements+k*ix->elemsz , key) < 0) ;
+  }
+  return index_result(ix , k , key) ;
+}
+
+/*
+  Takes as input a CVecIndex (ix), an array of nkeys elements (keys) and an array of nkeys ints (results), and fills in results
+  with the answer of cvec_index_search for each key. INDEX_BATCH searches are advanced one level at a time together,
+  so the cache misses of one search overlap with those of the others instead of happening one after the other.
+ */
+void cvec_index_search_n(const CVecIndex *ix, const void *keys, size_t nkeys, int *results){
+  const char *key = keys ;
+  for(size_t x = 0 ; x < nkeys ; x += INDEX_BATCH){
+    size_t batch = (nkeys-x < INDEX_BATCH) ? nkeys-x : INDEX_BATCH , k[INDEX_BATCH] ;
+    for(size_t b = 0 ; b < batch ; b++) k[b] = 1 ;
+    for(bool more = (ix->nelems > 0) ; more ;){
+      more = false ;
+      for(size_t b = 0 ; b < batch ; b++){
+        if(k[b] > ix->nelems) continue ; // this search is done, the others can be one level deeper
+        __builtin_prefetch(ix->elements+16*k[b]*ix->elemsz) ;
+        k[b] = 2*k[b]+(ix->cmp(ix->elements+k[b]*ix->elemsz , key+(x+b)*ix->elemsz) < 0) ;
+        more |= (k[b] <= ix->nelems) ;
+      }
+    }
+    for(size_t b = 0 ; b < batch ; b++) results[x+b] = index_result(ix , k[b] , key+(x+b)*ix->elemsz) ;
+  }
+}
+
 /*
   Takes as input a CVector (cv) and compartor (cmp) and sorts the vector using the qsort function.
  */
@@ -163,6 +416,330 @@ void cvec_sort(CVector *cv, CompareFn cmp){
   qsort(cv->elements , cv->nelems , cv->elemsz , cmp) ;
 }
 
+/*
+  Takes as input the address of an element (elem) and the description of its key (key) and returns the key as an
+  unsigned integer that orders the same way as the key: the sign bit of signed keys is flipped, and negative floats have
+  all their bits flipped.
+ */
+static uint64_t radix_key(const char *elem, const CVecKey *key){
+  uint64_t v = 0 ;
+  switch(key->width){
+    case 1 : v = *(const uint8_t*)(elem+key->offset) ; break ;
+    case 2 : { uint16_t x ; memcpy(&x , elem+key->offset , 2) ; v = x ; break ; }
+    case 4 : { uint32_t x ; memcpy(&x , elem+key->offset , 4) ; v = x ; break ; }
+    case 8 : memcpy(&v , elem+key->offset , 8) ; break ;
+  }
+  uint64_t sign = (uint64_t)1 << (key->width*8-1) ;
+  uint64_t mask = (key->width == 8) ? ~(uint64_t)0 : (sign << 1)-1 ;
+  if(key->type == CVEC_KEY_SIGNED) v ^= sign ;
+  else if(key->type == CVEC_KEY_FLOAT) v = (v & sign) ? ~v & mask : v | sign ;
+  return v ;
+}
+
+/*
+  Copies one element of elemsz bytes, with fixed size copies for the common sizes so they are not a call to memcpy.
+ */
+static inline void copy_elem(char *dst , const char *src , size_t elemsz){
+  if(elemsz == 4) memcpy(dst , src , 4) ;
+  else if(elemsz == 8) memcpy(dst , src , 8) ;
+  else memcpy(dst , src , elemsz) ;
+}
+
+/*
+  Takes as input a CVector (cv) and the description of a fixed width integer or floating point key inside its elements (key),
+  and sorts the elements by that key with a stable LSD radix sort: one counting pass over the keys, then one pass per byte of
+  the key that moves the elements into a scratch buffer and back. Bytes that are the same in every key are skipped.
+  Asserts if the key is not 1, 2, 4 or 8 bytes wide (or 4 or 8 for floats) or does not fit in the element.
+ */
+void cvec_sort_radix(CVector *cv, const CVecKey *key){
+  if((key->width != 1 && key->width != 2 && key->width != 4 && key->width != 8) || key->offset+key->width > cv->elemsz ||
+     (key->type == CVEC_KEY_FLOAT && key->width < 4)) assert("Invalid key") ;
+  size_t n = cv->nelems , elemsz = cv->elemsz ;
+  if(n < 2) return ;
+  char *tmp = malloc(n*elemsz) ;
+  size_t (*counts)[256] = calloc(key->width , sizeof(*counts)) ;
+  if(tmp == NULL || counts == NULL) assert("Allocation failure") ;
+
+  for(size_t x = 0 ; x < n ; x++){ // count every byte of every key in one pass
+    uint64_t v = radix_key(cv->elements+x*elemsz , key) ;
+    for(size_t b = 0 ; b < key->width ; b++) counts[b][(v >> (b*8)) & 0xff]++ ;
+  }
+
+  char *src = cv->elements , *dst = tmp ;
+  for(size_t b = 0 ; b < key->width ; b++){
+    if(counts[b][(radix_key(src , key) >> (b*8)) & 0xff] == n) continue ; // every key has the same byte here
+    size_t pos[256] , sum = 0 ;
+    for(int d = 0 ; d < 256 ; d++){
+      pos[d] = sum ;
+      sum += counts[b][d] ;
+    }
+    for(size_t x = 0 ; x < n ; x++){
+      const char *elem = src+x*elemsz ;
+      copy_elem(dst+(pos[(radix_key(elem , key) >> (b*8)) & 0xff]++)*elemsz , elem , elemsz) ;
+    }
+    char *swap = src ;
+    src = dst ;
+    dst = swap ;
+  }
+  if(src != cv->elements) memcpy(cv->elements , src , n*elemsz) ;
+  free(counts) ;
+  free(tmp) ;
+}
+
+/*
+  The chunks of a pool job still to run on one participant: [head, tail). The owner takes chunks from the head,
+  so it walks its part of the vector in order, and idle participants steal from the tail.
+ */
+struct chunk_range {
+  size_t head , tail ;
+  pthread_mutex_t lock ;
+};
+
+/*
+  The thread pool shared by cvec_parallel_for, cvec_reduce and cvec_sort_parallel, started on first use with one worker
+  per core besides the calling thread. A job is nchunks calls of fn(chunk, arg): the chunks are split into one contiguous
+  range per participant and a participant that runs out steals from the others, so an uneven job still keeps every
+  thread busy. One job runs at a time, generation tells the workers a new one was posted and finished counts the
+  workers done with it.
+ */
+struct threadpool {
+  int nworkers ;
+  struct chunk_range *ranges ; // one per worker, then the caller's
+  void (*fn)(size_t chunk , void *arg) ;
+  void *arg ;
+  unsigned long generation ;
+  int finished ;
+  pthread_mutex_t lock , run_lock ;
+  pthread_cond_t posted , done ;
+};
+
+static struct threadpool shared_pool ;
+static pthread_once_t shared_pool_once = PTHREAD_ONCE_INIT ;
+static __thread bool in_pool ; // set on pool threads and while a job runs, so a nested job runs inline
+
+/*
+  Takes a chunk from the range of participant id, from the head if it is its own (steal unset) or the tail otherwise.
+  Returns false if the range is empty.
+ */
+static bool take_chunk(struct threadpool *pool , int id , bool steal , size_t *chunk){
+  struct chunk_range *r = &pool->ranges[id] ;
+  bool found = false ;
+  pthread_mutex_lock(&r->lock) ;
+  if(r->head < r->tail){
+    *chunk = steal ? --r->tail : r->head++ ;
+    found = true ;
+  }
+  pthread_mutex_unlock(&r->lock) ;
+  return found ;
+}
+
+/*
+  Runs chunks of the current job as participant id until there are none left anywhere.
+ */
+static void participate(struct threadpool *pool , int id){
+  int n = pool->nworkers+1 ;
+  size_t chunk ;
+  while(1){
+    bool found = take_chunk(pool , id , false , &chunk) ;
+    for(int v = 1 ; !found && v < n ; v++) found = take_chunk(pool , (id+v)%n , true , &chunk) ;
+    if(!found) return ;
+    pool->fn(chunk , pool->arg) ;
+  }
+}
+
+static void *pool_worker(void *arg){
+  struct threadpool *pool = &shared_pool ;
+  int id = (int)(size_t)arg ;
+  unsigned long seen = 0 ;
+  in_pool = true ;
+  while(1){
+    pthread_mutex_lock(&pool->lock) ;
+    while(pool->generation == seen) pthread_cond_wait(&pool->posted , &pool->lock) ;
+    seen = pool->generation ;
+    pthread_mutex_unlock(&pool->lock) ;
+
+    participate(pool , id) ;
+
+    pthread_mutex_lock(&pool->lock) ;
+    if(++pool->finished == pool->nworkers) pthread_cond_signal(&pool->done) ;
+    pthread_mutex_unlock(&pool->lock) ;
+  }
+  return NULL ;
+}
+
+static void start_shared_pool(void){
+  struct threadpool *pool = &shared_pool ;
+  long ncores = sysconf(_SC_NPROCESSORS_ONLN) ;
+  pool->nworkers = (ncores > 1) ? (int)ncores-1 : 0 ;
+  pool->ranges = calloc(pool->nworkers+1 , sizeof(struct chunk_range)) ;
+  if(pool->ranges == NULL) pool->nworkers = 0 ;
+  pthread_mutex_init(&pool->lock , NULL) ;
+  pthread_mutex_init(&pool->run_lock , NULL) ;
+  pthread_cond_init(&pool->posted , NULL) ;
+  pthread_cond_init(&pool->done , NULL) ;
+  for(int x = 0 ; pool->ranges != NULL && x <= pool->nworkers ; x++) pthread_mutex_init(&pool->ranges[x].lock , NULL) ;
+  for(int x = 0 ; x < pool->nworkers ; x++){
+    pthread_t thread ;
+    if(pthread_create(&thread , NULL , pool_worker , (void*)(size_t)x) != 0){ // run with the workers started so far
+      pool->nworkers = x ;
+      break ;
+    }
+    pthread_detach(thread) ;
+  }
+}
+
+/*
+  Runs fn(chunk, arg) for every chunk in [0, nchunks) on the shared pool, the calling thread included, and returns
+  when all of them are done. Runs them in order on the calling thread if there is no pool or it is already inside a job.
+ */
+static void pool_run(size_t nchunks , void (*fn)(size_t chunk , void *arg) , void *arg){
+  pthread_once(&shared_pool_once , start_shared_pool) ;
+  struct threadpool *pool = &shared_pool ;
+  if(pool->nworkers == 0 || in_pool || nchunks < 2){
+    for(size_t x = 0 ; x < nchunks ; x++) fn(x , arg) ;
+    return ;
+  }
+
+  pthread_mutex_lock(&pool->run_lock) ; // one job at a time
+  int n = pool->nworkers+1 ;
+  for(int x = 0 ; x < n ; x++){
+    pool->ranges[x].head = nchunks*x/n ;
+    pool->ranges[x].tail = nchunks*(x+1)/n ;
+  }
+  pthread_mutex_lock(&pool->lock) ;
+  pool->fn = fn ;
+  pool->arg = arg ;
+  pool->finished = 0 ;
+  pool->generation++ ;
+  pthread_cond_broadcast(&pool->posted) ;
+  pthread_mutex_unlock(&pool->lock) ;
+
+  in_pool = true ;
+  participate(pool , pool->nworkers) ;
+  in_pool = false ;
+
+  pthread_mutex_lock(&pool->lock) ;
+  while(pool->finished < pool->nworkers) pthread_cond_wait(&pool->done , &pool->lock) ;
+  pthread_mutex_unlock(&pool->lock) ;
+  pthread_mutex_unlock(&pool->run_lock) ;
+}
+
+/*
+  A piece of work of cvec_sort_parallel: either qsort base[lo,hi), or merge the sorted runs src[alo,amid) and
+  src[amid,ahi) from output position lo up to hi into dst.
+ */
+struct sort_job {
+  char *src , *dst ;
+  size_t elemsz ;
+  CompareFn cmp ;
+  size_t lo , hi ; // the part of the output of this job
+  size_t alo , amid , ahi ; // the two runs being merged
+  bool merge ;
+};
+
+/*
+  Returns how many elements of a (of length na) come before output position k when merging a and b (of length nb).
+  Ties are taken from a first, so the merge is stable.
+ */
+static size_t corank(size_t k , const char *a , size_t na , const char *b , size_t nb , size_t elemsz , CompareFn cmp){
+  size_t lo = (k > nb) ? k-nb : 0 , hi = (k < na) ? k : na ;
+  while(lo < hi){
+    size_t i = lo+(hi-lo)/2 , j = k-i ;
+    if(j > 0 && cmp(b+(j-1)*elemsz , a+i*elemsz) >= 0) lo = i+1 ; // a[i] belongs before b[j-1]
+    else hi = i ;
+  }
+  return lo ;
+}
+
+static void sort_worker(struct sort_job *job){
+  size_t elemsz = job->elemsz ;
+  if(!job->merge){
+    qsort(job->src+job->lo*elemsz , job->hi-job->lo , elemsz , job->cmp) ;
+    return ;
+  }
+  const char *a = job->src+job->alo*elemsz , *b = job->src+job->amid*elemsz ;
+  size_t na = job->amid-job->alo , nb = job->ahi-job->amid ;
+  size_t k0 = job->lo-job->alo , k1 = job->hi-job->alo ; // output positions relative to the pair
+  size_t i = corank(k0 , a , na , b , nb , elemsz , job->cmp) , j = k0-i ;
+  size_t iend = corank(k1 , a , na , b , nb , elemsz , job->cmp) , jend = k1-iend ;
+  char *out = job->dst+job->lo*elemsz ;
+  while(i < iend && j < jend){
+    if(job->cmp(b+j*elemsz , a+i*elemsz) < 0) copy_elem(out , b+(j++)*elemsz , elemsz) ;
+    else copy_elem(out , a+(i++)*elemsz , elemsz) ;
+    out += elemsz ;
+  }
+  memcpy(out , a+i*elemsz , (iend-i)*elemsz) ;
+  memcpy(out+(iend-i)*elemsz , b+j*elemsz , (jend-j)*elemsz) ;
+}
+
+static void sort_chunk(size_t chunk , void *jobs){
+  sort_worker((struct sort_job*)jobs+chunk) ;
+}
+
+/*
+  Runs every job on the shared pool and waits for all of them.
+ */
+static void run_sort_jobs(struct sort_job *jobs , int njobs){
+  pool_run(njobs , sort_chunk , jobs) ;
+}
+
+/*
+  Takes as input a CVector (cv), a comparator (cmp) and a number of threads (nthreads, 0 for one per core) and sorts the
+  vector with a parallel merge sort on the shared pool: nthreads runs are qsorted, then the runs are merged in pairs until
+  one is left. Every merge round is split in nthreads jobs, each pair of runs being split into equal parts of the output
+  with a binary search, so the last merge is not done by a single thread. Vectors of fewer than PARALLEL_SORT_MIN elements are just qsorted.
+ */
+void cvec_sort_parallel(CVector *cv, CompareFn cmp, int nthreads){
+  if(nthreads <= 0) nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN) ;
+  if(nthreads > MAX_SORT_THREADS) nthreads = MAX_SORT_THREADS ;
+  size_t n = cv->nelems , elemsz = cv->elemsz ;
+  if(nthreads <= 1 || n < PARALLEL_SORT_MIN){
+    qsort(cv->elements , n , elemsz , cmp) ;
+    return ;
+  }
+  char *tmp = malloc(n*elemsz) ;
+  if(tmp == NULL){ // fall back on sorting in place
+    qsort(cv->elements , n , elemsz , cmp) ;
+    return ;
+  }
+
+  struct sort_job jobs[MAX_SORT_THREADS] ;
+  size_t runs[MAX_SORT_THREADS+1] ; // run x is [runs[x],runs[x+1])
+  int nruns = nthreads ;
+  for(int x = 0 ; x <= nruns ; x++) runs[x] = n*x/nruns ;
+  for(int x = 0 ; x < nruns ; x++){
+    jobs[x] = (struct sort_job){ .src = cv->elements , .elemsz = elemsz , .cmp = cmp , .lo = runs[x] , .hi = runs[x+1] } ;
+  }
+  run_sort_jobs(jobs , nruns) ;
+
+  char *src = cv->elements , *dst = tmp ;
+  while(nruns > 1){
+    int npairs = nruns/2 , njobs = 0 , per = nthreads/npairs ;
+    for(int p = 0 ; p < npairs ; p++){
+      size_t alo = runs[2*p] , amid = runs[2*p+1] , ahi = runs[2*p+2] ;
+      for(int x = 0 ; x < per ; x++){ // split the output of the pair between per threads
+        jobs[njobs++] = (struct sort_job){ .src = src , .dst = dst , .elemsz = elemsz , .cmp = cmp , .merge = true ,
+          .alo = alo , .amid = amid , .ahi = ahi , .lo = alo+(ahi-alo)*x/per , .hi = alo+(ahi-alo)*(x+1)/per } ;
+      }
+    }
+    if(nruns % 2){ // an odd run out is copied over as it is
+      size_t lo = runs[nruns-1] ;
+      memcpy(dst+lo*elemsz , src+lo*elemsz , (n-lo)*elemsz) ;
+    }
+    run_sort_jobs(jobs , njobs) ;
+
+    for(int x = 0 ; x < npairs ; x++) runs[x] = runs[2*x] ;
+    if(nruns % 2) runs[npairs++] = runs[nruns-1] ;
+    runs[npairs] = n ;
+    nruns = npairs ;
+    char *swap = src ;
+    src = dst ;
+    dst = swap ;
+  }
+  if(src != cv->elements) memcpy(cv->elements , src , n*elemsz) ;
+  free(tmp) ;
+}
+
 /*
   Takes as  input a CVector (cv) and returns the base of the vector (ie the first element)
  */
@@ -178,3 +755,84 @@ void *cvec_next(const CVector *cv, const void *prev){
   if(prev == cv->elements+(cv->nelems-1)*cv->elemsz) return NULL ;
   return (void*)((char*)prev+cv->elemsz) ;
 }
+
+/*
+  Takes as input a CVector (cv), a function (fn) and a pointer passed through to it (aux) and calls fn on every element in order.
+  Walks the elements with a pointer instead of an index and a compare against the last element on every step like cvec_next.
+ */
+void cvec_for_each(const CVector *cv, VisitElemFn fn, void *aux){
+  for(char *elem = cv->elements , *end = cv->elements+cv->nelems*cv->elemsz ; elem < end ; elem += cv->elemsz) fn(elem , aux) ;
+}
+
+/*
+  A cvec_parallel_for or cvec_reduce in progress: the vector cut in chunks of per elements, and for cvec_reduce
+  one partial result per chunk.
+ */
+struct parallel_job {
+  const CVector *cv ;
+  size_t per ;
+  VisitElemFn visit ;
+  FoldElemFn fold ;
+  void *aux ;
+  char *partials ;
+  size_t resultsz ;
+};
+
+/*
+  Returns the number of elements per chunk to cut n elements of elemsz bytes into, and the number of chunks in *nchunks.
+ */
+static size_t chunk_elems(size_t n , size_t elemsz , size_t *nchunks){
+  size_t per = PARALLEL_CHUNK/elemsz ;
+  if(per == 0) per = 1 ;
+  *nchunks = (n+per-1)/per ;
+  return per ;
+}
+
+static void for_chunk(size_t chunk , void *arg){
+  struct parallel_job *job = arg ;
+  const CVector *cv = job->cv ;
+  size_t lo = chunk*job->per , hi = (lo+job->per < cv->nelems) ? lo+job->per : cv->nelems ;
+  for(char *elem = cv->elements+lo*cv->elemsz , *end = cv->elements+hi*cv->elemsz ; elem < end ; elem += cv->elemsz) job->visit(elem , job->aux) ;
+}
+
+/*
+  Takes as input a CVector (cv), a function (fn) and a pointer passed through to it (aux) and calls fn on every element,
+  with the vector split in chunks run on the shared thread pool. fn is called on different elements at the same time
+  from different threads, in no particular order, and can change the element it is given but nothing shared without locking.
+ */
+void cvec_parallel_for(const CVector *cv, VisitElemFn fn, void *aux){
+  struct parallel_job job = { .cv = cv , .visit = fn , .aux = aux } ;
+  size_t nchunks ;
+  job.per = chunk_elems(cv->nelems , cv->elemsz , &nchunks) ;
+  pool_run(nchunks , for_chunk , &job) ;
+}
+
+static void reduce_chunk(size_t chunk , void *arg){
+  struct parallel_job *job = arg ;
+  const CVector *cv = job->cv ;
+  char *partial = job->partials+chunk*job->resultsz ;
+  size_t lo = chunk*job->per , hi = (lo+job->per < cv->nelems) ? lo+job->per : cv->nelems ;
+  for(char *elem = cv->elements+lo*cv->elemsz , *end = cv->elements+hi*cv->elemsz ; elem < end ; elem += cv->elemsz) job->fold(partial , elem , job->aux) ;
+}
+
+/*
+  Takes as input a CVector (cv), a result of resultsz bytes holding the identity of the reduction (result),
+  a function folding one element into a partial result (fold), a function merging a partial result into another (merge)
+  and a pointer passed through to both (aux). Every chunk of the vector is folded into its own copy of the identity on the
+  shared thread pool, then the partial results are merged into result in the order of the chunks, so result is the same
+  on every run as long as merge is associative.
+ */
+void cvec_reduce(const CVector *cv, void *result, size_t resultsz, FoldElemFn fold, MergeResultFn merge, void *aux){
+  struct parallel_job job = { .cv = cv , .fold = fold , .aux = aux , .resultsz = resultsz } ;
+  size_t nchunks ;
+  job.per = chunk_elems(cv->nelems , cv->elemsz , &nchunks) ;
+  if(nchunks == 0) return ;
+  job.partials = malloc(nchunks*resultsz) ;
+  if(job.partials == NULL) assert("Allocation failure") ;
+  for(size_t x = 0 ; x < nchunks ; x++) memcpy(job.partials+x*resultsz , result , resultsz) ;
+
+  pool_run(nchunks , reduce_chunk , &job) ;
+
+  for(size_t x = 0 ; x < nchunks ; x++) merge(result , job.partials+x*resultsz , aux) ;
+  free(job.partials) ;
+}